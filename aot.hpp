@@ -0,0 +1,35 @@
+#pragma once
+
+// Runtime support of the C++ emitted by --emit-cpp
+
+#include <cstdlib>
+#include <iostream>
+
+#include "bef_type.hpp"
+#include "stack.hpp"
+#include "heap.hpp"
+#include "grid.hpp"
+#include "interpreter.hpp"
+#include "random.hpp"
+
+
+// g, cells outside the grid read as 0
+inline bef_t aot_get(CodeGrid<char>& grid, bef_t x, bef_t y)
+{
+    int64_t i = bef2int(x), j = bef2int(y);
+    return char2bef(CodeGrid<char>::inside(j, i) ? grid(j, i) : 0);
+}
+
+// p, returns true if the cell changed and compiled code depends on it
+// covered has a '1' for every such cell
+inline bool aot_put(CodeGrid<char>& grid, const char* const* covered, bef_t v, bef_t x, bef_t y)
+{
+    int64_t i = bef2int(x), j = bef2int(y);
+    char c = bef2char(v);
+
+    // Writes outside the grid are ignored
+    if (!CodeGrid<char>::inside(j, i) || grid(j, i) == c) return false;
+
+    grid(j, i) = c;
+    return covered[j][i] == '1';
+}
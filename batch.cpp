@@ -0,0 +1,222 @@
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+
+#include "batch.hpp"
+
+namespace {
+
+struct Job
+{
+    std::string path;
+    uint64_t seed;
+    std::string output;
+    std::string error;
+    bool done = false;
+};
+
+// Jobs not started yet of one worker
+// The worker takes the oldest one, so that the output can be written early, and thieves take the newest one
+struct Queue
+{
+    std::mutex lock;
+    std::deque<size_t> jobs;
+};
+
+class Pool
+{
+private:
+    std::vector<Job>& jobs;
+
+    std::vector<Queue> queues;
+
+    const Vm::Options& options;
+
+    // Guards done of every job
+    std::mutex lock;
+    std::condition_variable finished;
+
+    // Next job of worker w, its own or stolen from another worker, returns false once there is none
+    bool take(unsigned w, size_t& job)
+    {
+        for (unsigned k = 0; k < queues.size(); k++)
+        {
+            Queue& q = queues[(w + k) % queues.size()];
+            std::lock_guard<std::mutex> guard(q.lock);
+            if (q.jobs.empty()) continue;
+
+            if (k == 0) job = q.jobs.front(), q.jobs.pop_front();
+            else job = q.jobs.back(), q.jobs.pop_back();
+            return true;
+        }
+        return false;
+    }
+
+    void run(Job& job)
+    {
+        Vm::Options o = options;
+        o.seed = job.seed;
+        Vm vm(o);
+        vm.set_output([](void* user, const char* data, size_t n) { ((std::string*) user)->append(data, n); }, &job.output);
+        vm.set_input([](void*, char*, size_t) -> size_t { return 0; }, nullptr);
+
+        if (vm.load_file(job.path.c_str())) vm.run();
+        if (vm.status() == Vm::Status::Error) job.error = vm.error();
+
+        std::lock_guard<std::mutex> guard(lock);
+        job.done = true;
+        finished.notify_all();
+    }
+
+    void work(unsigned w)
+    {
+        size_t job;
+        while (take(w, job)) run(jobs[job]);
+    }
+
+public:
+    Pool(std::vector<Job>& jobs, unsigned threads, const Vm::Options& options) :
+        jobs(jobs), queues(threads), options(options)
+    {
+        for (size_t j = 0; j < jobs.size(); j++) queues[j % threads].jobs.push_back(j);
+    }
+
+    // Runs the jobs, and hands each of them to report in order once it is done
+    template <class Report>
+    void run(Report report)
+    {
+        std::vector<std::thread> workers;
+        for (unsigned w = 0; w < queues.size(); w++) workers.emplace_back(&Pool::work, this, w);
+
+        for (Job& job : jobs)
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            finished.wait(guard, [&job] { return job.done; });
+            guard.unlock();
+            report(job);
+        }
+
+        for (std::thread& t : workers) t.join();
+    }
+};
+
+}
+
+
+int run_batch(const char* dir, unsigned threads, const Vm::Options& options)
+{
+    DIR* d = opendir(dir);
+    if (!d)
+    {
+        std::cerr << "Opening directory fail" << std::endl;
+        return 1;
+    }
+
+    std::vector<std::string> names;
+    while (dirent* e = readdir(d))
+    {
+        std::string name = e->d_name;
+        if (name.size() > 3 && name.compare(name.size() - 3, 3, ".bf") == 0) names.push_back(name);
+    }
+    closedir(d);
+    std::sort(names.begin(), names.end());
+
+    std::string prefix = dir;
+    if (!prefix.empty() && prefix.back() != '/') prefix += '/';
+
+    std::vector<Job> jobs(names.size());
+    for (size_t j = 0; j < names.size(); j++)
+    {
+        jobs[j].path = prefix + names[j];
+        jobs[j].seed = options.seed;
+    }
+
+    int status = 0;
+    Pool(jobs, std::max(threads, 1u), options).run([&status](Job& job)
+    {
+        std::cout << "==> " << job.path << " <==\n";
+        std::cout.write(job.output.data(), job.output.size());
+        std::cout.flush();
+        if (!job.error.empty())
+        {
+            std::cerr << job.path << ": " << job.error << std::endl;
+            status = 1;
+        }
+
+        // The output is no longer needed
+        std::string().swap(job.output);
+    });
+
+    return status;
+}
+
+
+int run_replicas(const char* filename, size_t replicas, unsigned threads, const Vm::Options& options,
+    const char* out_dir)
+{
+    std::vector<Job> jobs(replicas);
+    for (size_t j = 0; j < replicas; j++)
+    {
+        jobs[j].path = filename;
+        jobs[j].seed = options.seed + j;
+    }
+
+    // Number of copies that wrote each output, and the seed of the first one
+    std::map<std::string, std::pair<size_t, uint64_t>> outputs;
+
+    int status = 0;
+    size_t j = 0;
+    Pool(jobs, std::max(threads, 1u), options).run([&](Job& job)
+    {
+        if (!job.error.empty())
+        {
+            std::cerr << "replica " << j << ": " << job.error << std::endl;
+            status = 1;
+        }
+
+        if (out_dir)
+        {
+            std::string path = std::string(out_dir) + "/" + std::to_string(j) + ".out";
+            std::ofstream out(path, std::ios::binary);
+            out.write(job.output.data(), job.output.size());
+            if (!out)
+            {
+                std::cerr << "Writing " << path << " fail" << std::endl;
+                status = 1;
+            }
+        }
+        else
+        {
+            auto found = outputs.emplace(job.output, std::make_pair(0, job.seed)).first;
+            found->second.first++;
+        }
+
+        std::string().swap(job.output);
+        j++;
+    });
+
+    // Ties are left in the order of the outputs
+    typedef std::map<std::string, std::pair<size_t, uint64_t>>::const_iterator Entry;
+    std::vector<Entry> order;
+    for (Entry o = outputs.begin(); o != outputs.end(); ++o) order.push_back(o);
+    std::stable_sort(order.begin(), order.end(), [](Entry a, Entry b) { return a->second.first > b->second.first; });
+
+    for (Entry o : order)
+    {
+        std::cout << "==> " << o->second.first << " of " << replicas << " replicas, first with seed "
+                  << o->second.second << " <==\n";
+        std::cout.write(o->first.data(), o->first.size());
+    }
+    std::cout.flush();
+
+    return status;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "vm.hpp"
+
+// Runs every .bf file of dir on a pool of threads, each program in a Vm of its own with no input
+// The output of each program is captured and written in the order of the file names, after a header
+// naming the file, and the errors are written to the standard error
+// Returns 0 if every program ended with @, 1 otherwise
+int run_batch(const char* dir, unsigned threads, const Vm::Options& options);
+
+// Runs replicas copies of the program in filename on a pool of threads in the same way, copy i with ? seeded
+// with options.seed + i, so that it can be run again alone with that seed
+// With out_dir, the output of copy i goes to out_dir/<i>.out, otherwise every distinct output is written once
+// after a header with the number of copies that wrote it, the most frequent first
+// Returns 0 if every copy ended with @, 1 otherwise
+int run_replicas(const char* filename, size_t replicas, unsigned threads, const Vm::Options& options,
+    const char* out_dir);
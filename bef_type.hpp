@@ -2,6 +2,8 @@
 
 #include <iostream>
 #include "stdint.h"
+#include "output.hpp"
+#include "input.hpp"
 
 struct block;
 
@@ -14,10 +16,16 @@ union bef_t
     explicit operator bool() { return (i>>2) != 0; }
 };
 
-// The type of heap blocks
+// The type of heap blocks, see Heap for the encoding of their fields
+#ifdef BEF_COMPACT_HEAP
+typedef uint32_t ref_t;
+#else
+typedef bef_t ref_t;
+#endif
+
 struct block
 {
-    bef_t head, tail;
+    ref_t head, tail;
 };
 
 
@@ -51,8 +59,13 @@ inline bef_t operator%(bef_t lhs, bef_t rhs)
 
 inline bef_t operator>(bef_t lhs, bef_t rhs) { return int2bef(lhs.i > rhs.i); }
 
-inline void print_int(bef_t b) { std::cout << (b.i>>2); std::cout.flush(); }
+inline void print_int(bef_t b) { Output::put_int(b.i>>2); }
+
+inline void print_char(bef_t b) { Output::put_char(char(b.i>>2)); }
+
+inline bef_t read_int() { return int2bef(Input::read_int()); }
 
-inline void print_char(bef_t b) { std::cout << char(b.i>>2); std::cout.flush(); }
+// The byte as 0-255, or -1 at the end of the input
+inline bef_t read_char() { return int2bef(Input::read_char()); }
 
 inline bool is_ptr(bef_t b) { return !(b.i & 0b1); }
\ No newline at end of file
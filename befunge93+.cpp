@@ -1,539 +1,272 @@
-#include <array>
 #include <iostream>
-#include <string>
 #include <fstream>
+#include <string>
 #include <cstdlib>
 
-#include "bef_type.hpp"
-#include "stack.hpp"
-#include "heap.hpp"
+#include <thread>
+#include <unistd.h>
 
-// Width and height of code grid
-constexpr int gridH = 25, gridW = 80;
-// Instead of wrapping PC after every instruction surround grid with wrap instructions
-constexpr int realH = gridH + 2, realW = gridW + 2;
+#include "batch.hpp"
+#include "emit.hpp"
+#include "output.hpp"
+#include "profile.hpp"
+#include "stats.hpp"
+#include "tracer.hpp"
+#include "vm.hpp"
 
-enum class Direction : int { Up = -realW, Down = realW, Left = -1, Right = 1 };
 
-// Class for program counter
-class Position
+void print_usage()
 {
-private:
-    template<class T>
-    friend class CodeGrid;
-
-    int pos;
+    std::cout << "Usage:\n./befunge93 [--jit | --emit-cpp] [--lists] [--flush <policy>] [--writer-thread] [--generational]\n"
+              << "            [--incremental <budget>] [--heap-size <size>] [--stack-size <size>] [--huge-pages] [--stats]\n"
+              << "            [--profile <file>] [--trace <file>] [--checkpoint-every <steps>] [--checkpoint <file>]\n"
+              << "            [--seed <n>] <input_file> | --restore <file>\n"
+              << "./befunge93 --batch <dir> [-j <threads>] [--jit] [--generational] [--heap-size <size>] ...\n"
+              << "./befunge93 --replicas <n> [--replica-dir <dir>] [-j <threads>] [--seed <n>] ... <input_file>\n"
+              << "  --jit            compile hot paths of the grid to native code\n"
+              << "  --emit-cpp       write a C++ program running the grid to the standard output\n"
+              << "  --lists          make l, n, r, b and s list operations (length, nth, reverse, build, spill)\n"
+              << "  --flush <policy> when output is written: exit, line, input (default), size=<bytes> or time=<ms>\n"
+              << "  --writer-thread  write output from a background thread\n"
+              << "  --generational   allocate cells in a nursery collected apart from older cells\n"
+              << "  --incremental <budget>  mark in slices spread over the allocations, of at least budget blocks,\n"
+              << "                   or with a us suffix, of at most budget microseconds\n"
+              << "  --heap-size <size>   largest size of the heap in bytes, with an optional K, M or G suffix (default 128M)\n"
+              << "  --stack-size <size>  largest size of the stack in bytes, with an optional K, M or G suffix (default 8M)\n"
+              << "  --huge-pages     ask for transparent huge pages for the heap\n"
+              << "  --stats          write runtime statistics to the standard error at the end or on SIGINT (make STATS=1)\n"
+              << "  --profile <file> write the executions, time and g/p accesses of every cell to file as JSON\n"
+              << "  --trace <file>   record the last traces run and writes of p, written to file at the end, on error\n"
+              << "                   or on a signal, see befunge93-trace\n"
+              << "  --checkpoint-every <steps>  write a snapshot of the program every <steps> operations\n"
+              << "  --checkpoint <file>  where the snapshots go (default: <input_file>.snap, or the restored file)\n"
+              << "  --restore <file> resume the program of a snapshot instead of starting one\n"
+              << "  --seed <n>       seed of the directions ? picks (default 0)\n"
+              << "  --batch <dir>    run every .bf file of dir, writing their outputs in the order of their names\n"
+              << "  --replicas <n>   run n copies of the program, copy i seeded with <seed> + i, and write every distinct\n"
+              << "                   output with the number of copies that wrote it\n"
+              << "  --replica-dir <dir>  write the output of copy i to <dir>/<i>.out instead\n"
+              << "  -j <threads>     number of threads of --batch and --replicas (default: one per core)" << std::endl;
+}
 
-public:
-    Position(int y, int x) : pos((y + 1) * realW + (x + 1)) {}
 
-    Position& operator+=(Direction dir)
+// Parses the argument of --flush, returns false if it is not a policy
+bool parseFlush(const std::string& arg, Output::Policy& policy, size_t& threshold)
+{
+    static const std::pair<const char*, Output::Policy> policies[] =
     {
-        pos += static_cast<int>(dir);
-
-        return *this;
-    }
-
-    // Advance one horizontally
-    Position& operator++() { pos++; return *this; }
+        {"exit", Output::Policy::Exit}, {"line", Output::Policy::Line}, {"input", Output::Policy::Input},
+        {"size", Output::Policy::Size}, {"time", Output::Policy::Time}
+    };
 
-    void wrapX()
+    size_t eq = arg.find('=');
+    std::string name = arg.substr(0, eq);
+    threshold = 0;
+    if (eq != std::string::npos)
     {
-        auto quot_rem = std::div(pos, realW);
-        pos = quot_rem.quot * realW;
-        pos += (quot_rem.rem == 0) ? gridW : 1;
+        char* end;
+        threshold = std::strtoul(arg.c_str() + eq + 1, &end, 10);
+        if (*end != '\0' || end == arg.c_str() + eq + 1) return false;
     }
-    
-    void wrapY() { pos %= realH * realW; }
-};
+
+    for (auto& p : policies)
+        if (name == p.first)
+        {
+            // Only the thresholds are given a value
+            bool needs = p.second == Output::Policy::Size || p.second == Output::Policy::Time;
+            if (needs != (eq != std::string::npos)) return false;
+            policy = p.second;
+            return true;
+        }
+    return false;
+}
 
 
-// Type of code grid
-template<class T>
-class CodeGrid
+// Parses the budget of --incremental, a number of blocks or of microseconds with a us suffix
+bool parseBudget(const std::string& arg, Vm::Options& options)
 {
-private:
-    std::array<T, realH * realW> code;
+    char* end;
+    size_t budget = std::strtoul(arg.c_str(), &end, 10);
+    if (end == arg.c_str() || budget == 0) return false;
+
+    if (std::string(end) == "us") options.mark_slice_ns = budget * 1000;
+    else if (*end == '\0') options.mark_work = budget;
+    else return false;
+    return true;
+}
 
-public:
-    T& operator()(int y, int x) { return code[(y + 1) * realW + (x + 1)]; }
 
-    T& operator()(const Position& pos) { return code[pos.pos]; }
-};
+// Parses the argument of --seed, any 64-bit number
+bool parseSeed(const std::string& arg, uint64_t& seed)
+{
+    char* end;
+    seed = std::strtoull(arg.c_str(), &end, 10);
+    return end != arg.c_str() && *end == '\0' && arg[0] != '-';
+}
 
 
-void print_usage()
+// Parses a positive number of threads, copies or operations, returns false if it is not one
+bool parseCount(const std::string& arg, size_t& count)
 {
-    std::cout << "Usage:\n./befunge93 <input_file>" << std::endl;
+    char* end;
+    count = std::strtoul(arg.c_str(), &end, 10);
+    return end != arg.c_str() && *end == '\0' && arg[0] != '-' && count > 0;
 }
 
 
-// Reads code from file
-void readCode(CodeGrid<char>& code, const char* filename)
+// Parses a size in bytes with an optional K, M or G suffix, returns false if it is not one
+bool parseSize(const std::string& arg, size_t& size)
 {
-    std::ifstream file(filename);
-    
-    if (file.fail())
-    {
-        std::cerr << "Opening file fail" << std::endl;
-        exit(1);
-    }
+    char* end;
+    size = std::strtoul(arg.c_str(), &end, 10);
+    if (end == arg.c_str()) return false;
 
-    std::string line;
-    for (int i = 0; i < gridH; i++)
+    switch (*end)
     {
-        getline(file, line, '\n');
-        if (line.length() > gridW)
-        {
-            std::cerr << "Line width more than allowed. Line " << i << std::endl;
-            exit(1);
-        }
-
-        Position p(i, 0);
-        for(auto it = line.begin(); it != line.cend(); ++it, ++p) code(p) = *it;
-
-        if (file.eof()) break;
+        case 'K': size <<= 10; end++; break;
+        case 'M': size <<= 20; end++; break;
+        case 'G': size <<= 30; end++; break;
+        default: break;
     }
-
-    file.close();
+    return *end == '\0' && size > 0;
 }
 
-#define NEXT_INSTRUCTION(instr) goto* (instr);
-
-// Enum for instructions
-enum Instr
-{
-    Add,
-    Sub,
-    Mul,
-    Div,
-    Mod,
-    Not,
-    Grt,
-    Pc_right,
-    Pc_left,
-    Pc_up,
-    Pc_down,
-    Pc_rand,
-    Horif,
-    Verif,
-    Str,
-    Dup,
-    Swap,
-    Pop,
-    Print_int,
-    Print_char,
-    Bridge,
-    Get,
-    Put,
-    In_int,
-    In_char,
-    End,
-    Cell,
-    Head,
-    Tail,
-    Num, // Push number instruction
-    Nop, // <space>
-    Unk  // Unknown instruction. This is needed because characters other than the instructions are permitted in string mode
-};
-
 
 int main(int argc, char** argv)
 {
-    Position pc(0, 0);
-    Direction pc_dir = Direction::Right;
-    CodeGrid<char> rawCode;
-    CodeGrid<void*> code;
-
-    // Initialise code with nop intructions
-    for (int y = 0; y < gridH; y++)
-        for (int x = 0; x < gridW; x++)
-            rawCode(y, x) = ' ';
-    
-    // Wrap instructions
-    for (int y = 0; y < gridH; y++) code(y, -1) = code(y, gridW) = &&wrapX_label;
-    for (int x = 0; x < gridW; x++) code(-1, x) = code(gridH, x) = &&wrapY_label;
+    const char* filename = nullptr;
+    const char* batch = nullptr;
+    const char* profile_file = nullptr;
+    const char* trace_file = nullptr;
+    const char* restore = nullptr;
+    const char* replica_dir = nullptr;
+    size_t replicas = 0;
+    std::string checkpoint;
+    size_t checkpoint_every = 0;
+    bool emit = false, writer = false, stats = false, unknown = false, flush = false;
+    Output::Policy policy = Output::Policy::Input;
+    size_t threshold = 0;
+    size_t threads = std::thread::hardware_concurrency();
+    Vm::Options options;
+
+    for (int a = 1; a < argc; a++)
+    {
+        std::string arg = argv[a];
+        if (arg == "--jit") options.jit = true;
+        else if (arg == "--emit-cpp") emit = true;
+        else if (arg == "--writer-thread") writer = true;
+        else if (arg == "--generational") options.generational = true;
+        else if (arg == "--huge-pages") options.huge_pages = true;
+        else if (arg == "--lists") options.list_ops = true;
+        else if (arg == "--stats") stats = true;
+        else if (arg == "--flush" && a + 1 < argc && parseFlush(argv[a + 1], policy, threshold)) flush = true, a++;
+        else if (arg == "--incremental" && a + 1 < argc && parseBudget(argv[a + 1], options)) a++;
+        else if (arg == "--heap-size" && a + 1 < argc && parseSize(argv[a + 1], options.heap_size)) a++;
+        else if (arg == "--stack-size" && a + 1 < argc && parseSize(argv[a + 1], options.stack_size)) a++;
+        else if (arg == "--profile" && a + 1 < argc) profile_file = argv[++a];
+        else if (arg == "--trace" && a + 1 < argc) trace_file = argv[++a];
+        else if (arg == "--checkpoint-every" && a + 1 < argc && parseCount(argv[a + 1], checkpoint_every)) a++;
+        else if (arg == "--checkpoint" && a + 1 < argc) checkpoint = argv[++a];
+        else if (arg == "--restore" && a + 1 < argc && !restore) restore = argv[++a];
+        else if (arg == "--batch" && a + 1 < argc && !batch) batch = argv[++a];
+        else if (arg == "--replicas" && a + 1 < argc && parseCount(argv[a + 1], replicas)) a++;
+        else if (arg == "--replica-dir" && a + 1 < argc) replica_dir = argv[++a];
+        else if (arg == "--seed" && a + 1 < argc && parseSeed(argv[a + 1], options.seed)) a++;
+        else if (arg == "-j" && a + 1 < argc && parseCount(argv[a + 1], threads)) a++;
+        else if (arg.compare(0, 2, "--") != 0 && !filename) filename = argv[a];
+        else unknown = true, a = argc;
+    }
 
     // If the command line arguments are not as expected print usage
-    if (argc != 2)
+    // Batch and replicas only take the options of the Vms
+    bool many = batch || replicas;
+    if (unknown || (filename != nullptr) + (batch != nullptr) + (restore != nullptr) != 1 || (replicas && !filename)
+        || (many && (emit || flush || writer || stats || profile_file || trace_file || checkpoint_every)) || (restore && emit)
+        || (replica_dir && !replicas))
     {
         print_usage();
         return 0;
     }
-    else readCode(rawCode, argv[1]);
 
-    // array mapping instructions to labels
-    static void* labels[] =
+    if (stats && !Stats::compiled)
     {
-    // GCC does not yet support non-trivial designators unfortunately 
-        /*[Add]        =*/ &&add_label,
-        /*[Sub]        =*/ &&sub_label,
-        /*[Mul]        =*/ &&mul_label,
-        /*[Div]        =*/ &&div_label,
-        /*[Mod]        =*/ &&mod_label,
-        /*[Not]        =*/ &&not_label,
-        /*[Grt]        =*/ &&grt_label,
-        /*[Pc_right]   =*/ &&pc_right_label,
-        /*[Pc_left]    =*/ &&pc_left_label,
-        /*[Pc_up]      =*/ &&pc_up_label,
-        /*[Pc_down]    =*/ &&pc_down_label,
-        /*[Pc_rand]    =*/ &&pc_rand_label,
-        /*[Horif]      =*/ &&horif_label,
-        /*[Verif]      =*/ &&verif_label,
-        /*[Str]        =*/ &&str_label,
-        /*[Dup]        =*/ &&dup_label,
-        /*[Swap]       =*/ &&swap_label,
-        /*[Pop]        =*/ &&pop_label,
-        /*[Print_int]  =*/ &&print_int_label,
-        /*[Print_char] =*/ &&print_char_label,
-        /*[Bridge]     =*/ &&bridge_label,
-        /*[Get]        =*/ &&get_label,
-        /*[Put]        =*/ &&put_label,
-        /*[In_int]     =*/ &&in_int_label,
-        /*[In_char]    =*/ &&in_char_label,
-        /*[End]        =*/ &&end_label,
-        /*[Cell]       =*/ &&cell_label,
-        /*[Head]       =*/ &&hd_label,
-        /*[Tail]       =*/ &&tl_label,
-        /*[Num]        =*/ &&num_label,
-        /*[Nop]        =*/ &&nop_label,
-        /*[Unk]        =*/ &&unk_label
-    };
+        std::cerr << "--stats needs a build made with make STATS=1" << std::endl;
+        return 1;
+    }
 
-    // function that uses the array above to do the mapping
-    auto transf = [&] (int x, int y) -> void {
-        switch(rawCode(y, x))                                  
-        {                                                          
-            case '+':       code(y, x) = labels[Add];        break;
-            case '-':       code(y, x) = labels[Sub];        break;
-            case '*':       code(y, x) = labels[Mul];        break;
-            case '/':       code(y, x) = labels[Div];        break;
-            case '%':       code(y, x) = labels[Mod];        break;
-            case '!':       code(y, x) = labels[Not];        break;
-            case '`':       code(y, x) = labels[Grt];        break;
-            case '>':       code(y, x) = labels[Pc_right];   break;
-            case '<':       code(y, x) = labels[Pc_left];    break;
-            case '^':       code(y, x) = labels[Pc_up];      break;
-            case 'v':       code(y, x) = labels[Pc_down];    break;
-            case '?':       code(y, x) = labels[Pc_rand];    break;
-            case '_':       code(y, x) = labels[Horif];      break;
-            case '|':       code(y, x) = labels[Verif];      break;
-            case '"':       code(y, x) = labels[Str];        break;
-            case ':':       code(y, x) = labels[Dup];        break;
-            case '\\':      code(y, x) = labels[Swap];       break;
-            case '$':       code(y, x) = labels[Pop];        break;
-            case '.':       code(y, x) = labels[Print_int];  break;
-            case ',':       code(y, x) = labels[Print_char]; break;
-            case '#':       code(y, x) = labels[Bridge];     break;
-            case 'g':       code(y, x) = labels[Get];        break;
-            case 'p':       code(y, x) = labels[Put];        break;
-            case '&':       code(y, x) = labels[In_int];     break;
-            case '~':       code(y, x) = labels[In_char];    break;
-            case '@':       code(y, x) = labels[End];        break;
-            case 'c':       code(y, x) = labels[Cell];       break;
-            case 'h':       code(y, x) = labels[Head];       break;
-            case 't':       code(y, x) = labels[Tail];       break;
-            case '0'...'9': code(y, x) = labels[Num];        break;
-            case ' ':       code(y, x) = labels[Nop];        break;
-            default:        code(y, x) = labels[Unk];        break;
-        }                                                          
-    };
-    
-    // Do the mapping
-    for (int64_t y = 0; y < gridH; y++)
-        for (int64_t x = 0; x < gridW; x++)
-            transf(x, y);
-        
-    // variable that holds next instruction
-    // it is volatile so as to implement prefetching
-    void* volatile instr;
-    block* b;
-    bef_t v, v1, v2;
-    int64_t i, x, y;
-    char c;
-
-    instr = code(pc);
-    NEXT_INSTRUCTION(instr)
-
-//COMMAND         INITIAL STACK (bot->top)RESULT (STACK)
-
-// + (add)         <value1> <value2>       <value1 + value2>
-    add_label:
-        pc += pc_dir;
-        instr = code(pc);
-        Stack::push(Stack::pop() + Stack::pop());
-        NEXT_INSTRUCTION(instr)
-    
-// - (subtract)    <value1> <value2>       <value1 - value2>
-    sub_label:
-        pc += pc_dir;
-        instr = code(pc);
-        v2 = Stack::pop();
-        v1 = Stack::pop();
-        Stack::push(v1 - v2);
-        NEXT_INSTRUCTION(instr)
-
-// * (multiply)    <value1> <value2>       <value1 * value2>
-    mul_label:
-        pc += pc_dir;
-        instr = code(pc);
-        Stack::push(Stack::pop() * Stack::pop());
-        NEXT_INSTRUCTION(instr)
-
-// / (divide)      <value1> <value2>       <value1 / value2> (nb. integer)
-    div_label:
-        pc += pc_dir;
-        instr = code(pc);
-        v2 = Stack::pop();
-        v1 = Stack::pop();
-        Stack::push(v1 / v2);
-        NEXT_INSTRUCTION(instr)
-        
-// % (modulo)      <value1> <value2>       <value1 mod value2>
-    mod_label:
-        pc += pc_dir;
-        instr = code(pc);
-        v2 = Stack::pop();
-        v1 = Stack::pop();
-        Stack::push(v1 % v2);
-        NEXT_INSTRUCTION(instr)
-        
-// ! (not)         <value>                 <0 if value non-zero, 1 otherwise>
-    not_label:
-        pc += pc_dir;
-        instr = code(pc);
-        Stack::push(!Stack::pop());
-        NEXT_INSTRUCTION(instr)
-        
-// ` (greater)     <value1> <value2>       <1 if value1 > value2, 0 otherwise>
-    grt_label:
-        pc += pc_dir;
-        instr = code(pc);
-        v2 = Stack::pop();
-        v1 = Stack::pop();
-        Stack::push(v1 > v2);
-        NEXT_INSTRUCTION(instr)
-
-// > (right)                               PC -> right
-    pc_right_label:
-        pc_dir = Direction::Right;
-        pc += pc_dir;
-        instr = code(pc);
-        NEXT_INSTRUCTION(instr)
-
-// < (left)                                PC -> left
-    pc_left_label:
-        pc_dir = Direction::Left;
-        pc += pc_dir;
-        instr = code(pc);
-        NEXT_INSTRUCTION(instr)
-
-// ^ (up)                                  PC -> up
-    pc_up_label:
-        pc_dir = Direction::Up;
-        pc += pc_dir;
-        instr = code(pc);
-        NEXT_INSTRUCTION(instr)
-
-// v (down)                                PC -> down
-    pc_down_label:
-        pc_dir = Direction::Down;
-        pc += pc_dir;
-        instr = code(pc);
-        NEXT_INSTRUCTION(instr)
-
-// ? (random)                              PC -> right? left? up? down? ???
-    pc_rand_label:
-        switch (std::rand() % 4)
-        {
-            case 0:
-                pc_dir = Direction::Right;
-                break;
-            case 1:
-                pc_dir = Direction::Left;
-                break;
-            case 2:
-                pc_dir = Direction::Down;
-                break;
-            case 3:
-                pc_dir = Direction::Up;
-                break;
-        }
-        pc += pc_dir;
-        instr = code(pc);
-        NEXT_INSTRUCTION(instr)
-    
-// _ (horizontal if) <boolean value>       PC->left if <value>, else PC->right
-    horif_label:
-        pc_dir = (bool) Stack::pop() ? Direction::Left : Direction::Right;
-        pc += pc_dir;
-        instr = code(pc);
-        NEXT_INSTRUCTION(instr)
-        
-// | (vertical if)   <boolean value>       PC->up if <value>, else PC->down
-    verif_label:
-        pc_dir = (bool) Stack::pop() ? Direction::Up : Direction::Down;
-        pc += pc_dir;
-        instr = code(pc);
-        NEXT_INSTRUCTION(instr)
-        
-// " (stringmode)                          Toggles 'stringmode'
-    str_label:
-        pc += pc_dir;
-        while((c = rawCode(pc)) != '"')
-        {
-            void* w = code(pc);
-            if ( w == &&wrapX_label) pc.wrapX();
-            else if (w == &&wrapY_label) pc.wrapY();
-            else
+    if (batch) return run_batch(batch, threads, options);
+    if (replicas) return run_replicas(filename, replicas, threads, options, replica_dir);
+
+    Profile profile;
+    Tracer tracer;
+    Vm vm(options);
+    if (profile_file) vm.set_profile(&profile);
+    if (trace_file) vm.set_tracer(&tracer);
+    if (restore ? !vm.restore(restore) : !vm.load_file(filename))
+    {
+        std::cerr << vm.error() << std::endl;
+        return 1;
+    }
+
+    if (emit)
+    {
+        emit_cpp(vm.grid(), filename, std::cout, options.list_ops);
+        return 0;
+    }
+
+    Output::install_signal_handlers();
+    if (flush) Output::configure(policy, threshold);
+    if (writer) Output::start_writer();
+    if (stats) Stats::start();
+    if (profile_file) profile.start();
+    if (trace_file) tracer.start(trace_file);
+
+    if (checkpoint.empty()) checkpoint = restore ? restore : std::string(filename) + ".snap";
+
+    Vm::Status status;
+    if (!checkpoint_every) status = vm.run();
+    else
+        while ((status = vm.run(checkpoint_every)) == Vm::Status::Paused)
+            if (!vm.checkpoint(checkpoint.c_str()))
             {
-                Stack::push(char2bef(c));
-                pc += pc_dir;
+                std::cerr << "Writing checkpoint fail" << std::endl;
+                return 1;
             }
+    if (stats) Stats::report();
+
+    if (trace_file)
+    {
+        tracer.stop();
+        if (!tracer.dump(trace_file))
+        {
+            std::cerr << "Writing trace fail" << std::endl;
+            return 1;
         }
-        pc += pc_dir;
-        instr = code(pc);
-        NEXT_INSTRUCTION(instr)
-        
-// : (dup)         <value>                 <value> <value>
-    dup_label:
-        pc += pc_dir;
-        instr = code(pc);
-        Stack::push(Stack::head());
-        NEXT_INSTRUCTION(instr)
-        
-// \ (swap)        <value1> <value2>       <value2> <value1>
-    swap_label:
-        pc += pc_dir;
-        instr = code(pc);
-        v2 = Stack::pop();
-        v1 = Stack::pop();
-        Stack::push(v2);
-        Stack::push(v1);
-        NEXT_INSTRUCTION(instr)
-    
-// $ (pop)         <value>                 pops <value> but does nothing
-    pop_label:
-        pc += pc_dir;
-        instr = code(pc);
-        Stack::pop();
-        NEXT_INSTRUCTION(instr)
-
-// . (output int)  <value>                 outputs <value> as integer
-    print_int_label:
-        pc += pc_dir;
-        instr = code(pc);
-        print_int(Stack::pop());
-        NEXT_INSTRUCTION(instr)
-
-// , (output char) <value>                 outputs <value> as ASCII
-    print_char_label:
-        pc += pc_dir;
-        instr = code(pc);
-        print_char(Stack::pop());
-        NEXT_INSTRUCTION(instr)
-
-// # (bridge)                              'jumps' PC one farther; skips
-//                                         over next command
-    bridge_label:
-        pc += pc_dir;
-        pc += pc_dir;
-        instr = code(pc);
-        NEXT_INSTRUCTION(instr)
-
-// g (get)         <x> <y>                 <value at (x,y)>
-    get_label:
-        pc += pc_dir;
-        instr = code(pc);
-        y = bef2int(Stack::pop());
-        x = bef2int(Stack::pop());
-        Stack::push(char2bef(rawCode(y, x)));
-        NEXT_INSTRUCTION(instr)
-
-// p (put)         <value> <x> <y>         puts <value> at (x,y)
-    put_label:
-        pc += pc_dir;
-        instr = code(pc);
-        y = bef2int(Stack::pop());
-        x = bef2int(Stack::pop());
-        v = Stack::pop();
-        rawCode(y, x) = bef2char(v);
-        transf(x, y);
-        NEXT_INSTRUCTION(instr)
-
-// & (input int)                           <value user entered>
-    in_int_label:
-        pc += pc_dir;
-        instr = code(pc);
-        std::cin >> i;
-        Stack::push(int2bef(i));
-        NEXT_INSTRUCTION(instr)
-        
-// ~ (input character)                     <character user entered>
-    in_char_label:
-        pc += pc_dir;
-        instr = code(pc);
-        std::cin >> c;
-        Stack::push(char2bef(c));
-        NEXT_INSTRUCTION(instr)
-
-// @ (end)                                 ends program
-    end_label:
-        return 0;
+    }
 
-// c (cons)        <value1> <value2>       <address of allocated cons cell in the heap
-//                                         with head = <value1> and tail = <value2> >
-    cell_label:
-        pc += pc_dir;
-        instr = code(pc);
-        b = Heap::alloc();
-        v2 = Stack::pop();
-        v1 = Stack::pop();
-        b->head = v1;
-        b->tail = v2;
-        Stack::push(bef_t{.ptr = b});
-        NEXT_INSTRUCTION(instr)
-
-// h (head)        <value>                 <head of cons cell with address <value> >
-    hd_label:
-        pc += pc_dir;
-        instr = code(pc);
-        b = Stack::pop().ptr;
-        Stack::push(b->head);
-        NEXT_INSTRUCTION(instr)
-
-// t (tail)        <value>                 <tail of cons cell with address <value> >
-    tl_label:
-        pc += pc_dir;
-        instr = code(pc);
-        b = Stack::pop().ptr;
-        Stack::push(b->tail);
-        NEXT_INSTRUCTION(instr)
-
-// 0...9                                   push number
-    num_label:
-        Stack::push(int2bef(rawCode(pc) - '0'));
-        pc += pc_dir;
-        instr = code(pc);
-        NEXT_INSTRUCTION(instr)
-
-// <space>                                no operation
-    nop_label:
-        pc += pc_dir;
-        instr = code(pc);
-        NEXT_INSTRUCTION(instr)
-
-    unk_label:
-        std::cerr << "Unknown instruction: " << rawCode(pc) << std::endl;
+    if (checkpoint_every && !vm.wait_checkpoint())
+    {
+        std::cerr << "Writing checkpoint fail" << std::endl;
         return 1;
+    }
 
-    wrapX_label:
-        pc.wrapX();
-        instr = code(pc);
-        NEXT_INSTRUCTION(instr)
+    if (profile_file)
+    {
+        profile.stop();
+        std::ofstream out(profile_file);
+        profile.write_json(out, vm.grid());
+        if (!out)
+        {
+            std::cerr << "Writing profile fail" << std::endl;
+            return 1;
+        }
+        if (isatty(STDERR_FILENO)) profile.write_heatmap(std::cerr, vm.grid());
+    }
 
-    wrapY_label:
-        pc.wrapY();
-        instr = code(pc);
-        NEXT_INSTRUCTION(instr)
+    if (status == Vm::Status::Error)
+    {
+        std::cerr << vm.error() << std::endl;
+        return 1;
+    }
+    return 0;
 }
@@ -0,0 +1,256 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "harness.hpp"
+
+// Benchmark harness, runs every .bf file of a directory in each mode and checks its output against the .out file
+// next to it, feeding it the .in file if there is one
+// Each run is made in a child process, so that its peak RSS is its own
+
+namespace {
+
+// What a child sends back of its run
+struct Result
+{
+    bool ok;
+    char error[64];
+    double seconds;
+    uint64_t steps;
+    uint64_t collections;
+    uint64_t p50, p99, max;    // Pauses in nanoseconds
+    long rss_kb;
+};
+
+std::vector<uint64_t> pauses;
+
+void record_pause(uint64_t ns)
+{
+    pauses.push_back(ns);
+}
+
+
+// Runs w in the current process, which is a child of the harness
+Result run_child(const Program& w, const Mode& mode)
+{
+    Result r = Result();
+
+    Vm vm(options_of(mode));
+
+    std::string output;
+    vm.set_output([](void* user, const char* data, size_t n) { ((std::string*) user)->append(data, n); }, &output);
+
+    std::pair<const std::string*, size_t> input(&w.input, 0);
+    vm.set_input([](void* user, char* data, size_t n) -> size_t
+    {
+        auto* in = (std::pair<const std::string*, size_t>*) user;
+        n = std::min(n, in->first->size() - in->second);
+        std::memcpy(data, in->first->data() + in->second, n);
+        in->second += n;
+        return n;
+    }, &input);
+
+    if (!vm.load(w.code.data(), w.code.size()))
+    {
+        std::snprintf(r.error, sizeof(r.error), "%s", vm.error().c_str());
+        return r;
+    }
+
+    pauses.reserve(1 << 16);
+    Heap::set_pause_hook(record_pause);
+
+    auto start = std::chrono::steady_clock::now();
+    Vm::Status status = vm.run();
+    r.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    Heap::set_pause_hook(nullptr);
+
+    r.steps = vm.steps();
+    r.collections = pauses.size();
+    if (!pauses.empty())
+    {
+        std::sort(pauses.begin(), pauses.end());
+        r.p50 = pauses[(pauses.size() - 1) * 50 / 100];
+        r.p99 = pauses[(pauses.size() - 1) * 99 / 100];
+        r.max = pauses.back();
+    }
+
+    if (status == Vm::Status::Error) std::snprintf(r.error, sizeof(r.error), "%s", vm.error().c_str());
+    else if (output != w.expected) std::snprintf(r.error, sizeof(r.error), "output differs from the .out file");
+    else r.ok = true;
+    return r;
+}
+
+
+// Runs w in a child process
+Result run(const Program& w, const Mode& mode)
+{
+    Result r = Result();
+
+    int fds[2];
+    if (pipe(fds) != 0)
+    {
+        std::snprintf(r.error, sizeof(r.error), "pipe failed");
+        return r;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(fds[0]);
+        Result child = run_child(w, mode);
+        ssize_t n = write(fds[1], &child, sizeof(child));
+        _exit(n == (ssize_t) sizeof(child) ? 0 : 1);
+    }
+    close(fds[1]);
+
+    bool received = pid > 0 && read(fds[0], &r, sizeof(r)) == (ssize_t) sizeof(r);
+    close(fds[0]);
+
+    int status = 0;
+    rusage usage;
+    if (pid > 0 && wait4(pid, &status, 0, &usage) == pid) r.rss_kb = usage.ru_maxrss;
+
+    if (!received)
+    {
+        r = Result();
+        std::snprintf(r.error, sizeof(r.error), "crashed with status %d", status);
+    }
+    return r;
+}
+
+
+// Millions of cells per second, cells being the operations of the traces run
+double mcells(const Result& r)
+{
+    return r.seconds > 0 ? r.steps / r.seconds / 1e6 : 0;
+}
+
+
+// Baseline throughputs by "workload mode"
+std::map<std::string, double> read_baseline(const std::string& path)
+{
+    std::map<std::string, double> baseline;
+    std::ifstream file(path);
+    std::string name, mode;
+    double rate;
+    while (file >> name >> mode >> rate) baseline[name + " " + mode] = rate;
+    return baseline;
+}
+
+
+void print_usage()
+{
+    std::printf("Usage:\n./befunge93-bench [--runs <n>] [--record | --tolerance <percent>] <dir>\n"
+                "  --runs <n>             runs of each workload and mode, the fastest one counts (default 5)\n"
+                "  --record               write the throughputs to <dir>/baseline.txt\n"
+                "  --tolerance <percent>  slowdown against <dir>/baseline.txt counted as a regression (default 20)\n");
+}
+
+}
+
+
+int main(int argc, char** argv)
+{
+    const char* dir = nullptr;
+    bool record = false;
+    int runs = 5;
+    double tolerance = 20;
+
+    for (int a = 1; a < argc; a++)
+    {
+        std::string arg = argv[a];
+        if (arg == "--record") record = true;
+        else if (arg == "--runs" && a + 1 < argc && (runs = std::atoi(argv[a + 1])) > 0) a++;
+        else if (arg == "--tolerance" && a + 1 < argc && (tolerance = std::atof(argv[a + 1])) > 0) a++;
+        else if (arg.compare(0, 2, "--") != 0 && !dir) dir = argv[a];
+        else dir = nullptr, a = argc;
+    }
+
+    if (!dir)
+    {
+        print_usage();
+        return 0;
+    }
+
+    std::vector<Program> workloads = load_programs(dir);
+    if (workloads.empty())
+    {
+        std::fprintf(stderr, "No workloads in %s\n", dir);
+        return 1;
+    }
+
+    std::string baseline_path = std::string(dir) + "/baseline.txt";
+    std::map<std::string, double> baseline;
+    if (!record) baseline = read_baseline(baseline_path);
+
+    std::ostringstream recorded;
+    int failures = 0;
+
+    std::printf("%-10s %-9s %9s %9s %6s %9s %9s %9s %8s  %s\n",
+                "workload", "mode", "time(s)", "Mcells/s", "GCs", "p50(us)", "p99(us)", "max(us)", "RSS(MB)", "result");
+
+    for (const Program& w : workloads)
+        for (const Mode& mode : modes)
+        {
+            if (!runs_in(w, mode)) continue;
+
+            Result best = Result();
+            long rss_kb = 0;
+            for (int i = 0; i < runs; i++)
+            {
+                Result r = run(w, mode);
+                rss_kb = std::max(rss_kb, r.rss_kb);
+                if (!r.ok || !best.ok || r.seconds < best.seconds) best = r;
+                if (!r.ok) break;
+            }
+
+            std::string key = w.name + " " + mode.name;
+            std::string verdict = "ok";
+            if (!best.ok) verdict = std::string("FAIL: ") + best.error;
+            else if (baseline.count(key))
+            {
+                double floor = baseline[key] * (1 - tolerance / 100);
+                if (mcells(best) < floor)
+                {
+                    char s[64];
+                    std::snprintf(s, sizeof(s), "REGRESSION: %.1f < %.1f Mcells/s", mcells(best), floor);
+                    verdict = s;
+                }
+            }
+            if (verdict != "ok") failures++;
+
+            std::printf("%-10s %-9s %9.3f %9.1f %6llu %9.1f %9.1f %9.1f %8.1f  %s\n",
+                        w.name.c_str(), mode.name, best.seconds, mcells(best), (unsigned long long) best.collections,
+                        best.p50 / 1e3, best.p99 / 1e3, best.max / 1e3, rss_kb / 1024.0, verdict.c_str());
+            std::fflush(stdout);
+
+            recorded << key << " " << mcells(best) << "\n";
+        }
+
+    if (record)
+    {
+        if (failures)
+        {
+            std::fprintf(stderr, "Not recording a baseline with failing workloads\n");
+            return 1;
+        }
+
+        std::ofstream(baseline_path) << recorded.str();
+        std::printf("Baseline written to %s\n", baseline_path.c_str());
+    }
+    else if (baseline.empty()) std::printf("No baseline, run with --record to write %s\n", baseline_path.c_str());
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,2 @@
+99*9*9*9*9*9*4:*:*:*:**  >:4:*:*:*:*/:       v
+                         ^  -*:*:*:*:4+%*2*88_$.@
@@ -0,0 +1,4 @@
+0:c"}}}"**>\0"}"-\c\::c$::c$::c$::c$1-:v
+          ^                            _$0\>:h"}"+v
+                                               @.$_t\1+\v
+                                           ^            <
@@ -0,0 +1,2 @@
+0"}}"*"}"*4*>          :9%"0"+"$"0p\ +\1-:v
+            ^                             _$.@
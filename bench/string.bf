@@ -0,0 +1,2 @@
+0"}}"*8*8*>\0"the quick brown fox jumps over the lazy dog">:#$_$1+\1-:v
+          ^                                                           _$.@
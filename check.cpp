@@ -0,0 +1,261 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "batch.hpp"
+#include "harness.hpp"
+
+// Test harness, runs every .bf file of a directory through the Vm and checks its output against the .out file
+// next to it, feeding it the .in file if there is one. A program with a .err file has to fail with that message
+// Every program is run in each mode of harness.hpp in several ways, which all have to give the same output:
+// - whole: in a single run
+// - paused: pausing every few operations, taking turns with a second Vm running the same program
+// - restored: checkpointed halfway and restored in a Vm with another seed, for programs with no input
+// - replicas: as copies run by --replicas, each giving what a Vm with its seed gives alone, for programs with no input
+// Restoring a snapshot into a heap too small for its cells also has to fail the Vm rather than end the process
+
+namespace {
+
+// Seed of the runs, and of the first replica, the one of befunge93+ and of the programs compiled ahead of time
+constexpr uint64_t SEED = Random::DEFAULT_SEED;
+
+constexpr size_t REPLICAS = 4;
+
+// Operations between pauses of the two Vms of the paused runs
+constexpr uint64_t PAUSE_STEPS[] = {1, 100};
+
+// The input is handed out this many bytes at a time, so that numbers are split across reads
+constexpr size_t FEED_SIZE = 3;
+
+// A program leaving a list of 15625 cells on the stack before it ends, which do not fit a heap of SMALL_HEAP bytes
+const char LIST_CODE[] = "0\"}}\"*>\\0\\c\\1-:v\n      ^        _@\n";
+
+constexpr size_t SMALL_HEAP = 64 << 10;
+
+// Heap of the runs, small enough that the programs making many cells are collected a few times
+constexpr size_t HEAP_SIZE = 4 << 20;
+
+struct Feed
+{
+    const std::string* data;
+    size_t pos;
+};
+
+size_t feed(void* user, char* data, size_t n)
+{
+    Feed* f = (Feed*) user;
+    n = std::min(std::min(n, FEED_SIZE), f->data->size() - f->pos);
+    std::memcpy(data, f->data->data() + f->pos, n);
+    f->pos += n;
+    return n;
+}
+
+
+void collect(void* user, const char* data, size_t n)
+{
+    ((std::string*) user)->append(data, n);
+}
+
+
+Vm::Options options_of(const Mode& mode, uint64_t seed)
+{
+    Vm::Options options = options_of(mode);
+    options.heap_size = HEAP_SIZE;
+    options.seed = seed;
+    return options;
+}
+
+
+// A Vm with its input taken from a test and its output collected
+struct Run
+{
+    Vm vm;
+    std::string output;
+    Feed input;
+
+    Run(const Program& t, const Mode& mode, uint64_t seed) : vm(options_of(mode, seed)), input{&t.input, 0}
+    {
+        vm.set_output(collect, &output);
+        vm.set_input(feed, &input);
+    }
+};
+
+
+// What is wrong with the end of a run of t with the given output, empty if nothing
+std::string verdict(const Program& t, const Vm& vm, const std::string& output)
+{
+    if (vm.status() == Vm::Status::Paused) return "did not end";
+    if (vm.status() == Vm::Status::Error && vm.error() != t.error) return vm.error();
+    if (vm.status() == Vm::Status::Finished && !t.error.empty()) return "did not fail with " + t.error;
+    if (output != t.expected) return "output differs from the .out file";
+    return "";
+}
+
+
+std::string check_whole(const Program& t, const Mode& mode, uint64_t& steps)
+{
+    Run p(t, mode, SEED);
+    if (!p.vm.load(t.code.data(), t.code.size())) return p.vm.error();
+    p.vm.run();
+    steps = p.vm.steps();
+    return verdict(t, p.vm, p.output);
+}
+
+
+std::string check_paused(const Program& t, const Mode& mode)
+{
+    Run a(t, mode, SEED), b(t, mode, SEED);
+    if (!a.vm.load(t.code.data(), t.code.size()) || !b.vm.load(t.code.data(), t.code.size())) return a.vm.error();
+
+    while (a.vm.status() == Vm::Status::Paused || b.vm.status() == Vm::Status::Paused)
+    {
+        a.vm.run(PAUSE_STEPS[0]);
+        b.vm.run(PAUSE_STEPS[1]);
+    }
+
+    std::string wrong = verdict(t, a.vm, a.output);
+    if (wrong.empty()) wrong = verdict(t, b.vm, b.output);
+    return wrong;
+}
+
+
+std::string check_restored(const Program& t, const Mode& mode, uint64_t steps, const std::string& snapshot)
+{
+    Run first(t, mode, SEED);
+    if (!first.vm.load(t.code.data(), t.code.size())) return first.vm.error();
+    if (first.vm.run(steps / 2) != Vm::Status::Paused) return verdict(t, first.vm, first.output);
+    if (!first.vm.checkpoint(snapshot.c_str()) || !first.vm.wait_checkpoint()) return "writing the snapshot failed";
+
+    // The generator of ? comes from the snapshot, not from the seed of the Vm
+    Run second(t, mode, SEED + REPLICAS);
+    if (!second.vm.restore(snapshot.c_str())) return second.vm.error();
+    second.vm.run();
+    std::remove(snapshot.c_str());
+    return verdict(t, second.vm, first.output + second.output);
+}
+
+
+std::string check_replicas(const Program& t, const Mode& mode, const std::string& dir)
+{
+    if (run_replicas(t.path.c_str(), REPLICAS, 2, options_of(mode, SEED), dir.c_str()) != 0) return "a replica failed";
+
+    std::string wrong;
+    for (size_t i = 0; i < REPLICAS; i++)
+    {
+        std::string path = dir + "/" + std::to_string(i) + ".out";
+        std::string output;
+        read_file(path, output);
+        std::remove(path.c_str());
+
+        Run alone(t, mode, SEED + i);
+        alone.vm.load(t.code.data(), t.code.size());
+        alone.vm.run();
+        if (wrong.empty() && output != alone.output) wrong = "replica " + std::to_string(i) + " differs from its seed alone";
+    }
+    return wrong;
+}
+
+
+// Restoring a snapshot whose cells do not fit the heap fails the Vm instead of ending the process
+std::string check_small_heap(const Mode& mode, const std::string& snapshot)
+{
+    Vm whole(options_of(mode, SEED));
+    whole.load(LIST_CODE, sizeof(LIST_CODE) - 1);
+    if (whole.run() != Vm::Status::Finished) return whole.error();
+
+    Vm first(options_of(mode, SEED));
+    first.load(LIST_CODE, sizeof(LIST_CODE) - 1);
+    if (first.run(whole.steps() - 1) != Vm::Status::Paused) return "did not pause";
+    if (!first.checkpoint(snapshot.c_str()) || !first.wait_checkpoint()) return "writing the snapshot failed";
+
+    Vm::Options options = options_of(mode, SEED);
+    options.heap_size = SMALL_HEAP;
+    Vm second(options);
+    bool restored = second.restore(snapshot.c_str());
+    std::remove(snapshot.c_str());
+    if (restored) return "restored into a heap too small";
+    return second.error() == "Not enough memory" ? "" : second.error();
+}
+
+
+void print_usage()
+{
+    std::printf("Usage:\n./befunge93-check <dir>\n");
+}
+
+}
+
+
+int main(int argc, char** argv)
+{
+    if (argc != 2)
+    {
+        print_usage();
+        return 0;
+    }
+
+    std::vector<Program> tests = load_programs(argv[1]);
+    if (tests.empty())
+    {
+        std::fprintf(stderr, "No tests in %s\n", argv[1]);
+        return 1;
+    }
+
+    char temp[] = "/tmp/befunge93-check.XXXXXX";
+    if (!mkdtemp(temp))
+    {
+        std::fprintf(stderr, "Making a temporary directory fail\n");
+        return 1;
+    }
+    std::string snapshot = std::string(temp) + "/snap";
+
+    int failures = 0;
+    std::printf("%-14s %-9s %-8s  %s\n", "test", "mode", "check", "result");
+
+    for (const Program& t : tests)
+        for (const Mode& mode : modes)
+        {
+            if (!runs_in(t, mode)) continue;
+
+            // Programs with input would read it again from its start once restored, and replicas get none
+            bool alone = t.input.empty();
+            uint64_t steps = 0;
+            std::string whole = check_whole(t, mode, steps);
+            std::string paused = check_paused(t, mode);
+            std::string restored = alone ? check_restored(t, mode, steps, snapshot) : "";
+            std::string replicas = alone && t.error.empty() ? check_replicas(t, mode, temp) : "";
+
+            const std::pair<const char*, const std::string*> checks[] =
+            {
+                {"whole", &whole}, {"paused", &paused},
+                {"restored", alone ? &restored : nullptr}, {"replicas", alone && t.error.empty() ? &replicas : nullptr}
+            };
+
+            for (auto& c : checks)
+            {
+                std::string result = !c.second ? "skipped" : c.second->empty() ? "ok" : "FAIL: " + *c.second;
+                if (c.second && !c.second->empty()) failures++;
+                std::printf("%-14s %-9s %-8s  %s\n", t.name.c_str(), mode.name, c.first, result.c_str());
+            }
+            std::fflush(stdout);
+        }
+
+    for (const Mode& mode : modes)
+    {
+        std::string small_heap = check_small_heap(mode, snapshot);
+        if (!small_heap.empty()) failures++;
+        std::printf("%-14s %-9s %-8s  %s\n", "small_heap", mode.name, "restored",
+                    small_heap.empty() ? "ok" : ("FAIL: " + small_heap).c_str());
+    }
+
+    rmdir(temp);
+
+    std::printf("%d failed\n", failures);
+    return failures ? 1 : 0;
+}
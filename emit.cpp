@@ -0,0 +1,326 @@
+#include <bitset>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "emit.hpp"
+#include "trace.hpp"
+
+namespace {
+
+// Character or string literal of C++ for a character of the grid
+std::string literal(char c)
+{
+    if (c == '"' || c == '\\' || c == '\'' || c == '?' || c < ' ' || c > '~')
+    {
+        static const char digits[] = "01234567";
+        unsigned char u = c;
+        return std::string("\\") + digits[u >> 6] + digits[(u >> 3) & 7] + digits[u & 7];
+    }
+    return std::string(1, c);
+}
+
+std::string label(int state) { return "s" + std::to_string(state); }
+
+std::string constant(bef_t b) { return "int2bef(" + std::to_string(bef2int(b)) + ")"; }
+
+
+// Writes the statements of one trace
+// The values pushed by the trace are kept in local variables and only pushed on the stack
+// at the exit or before the stack is needed, so the C++ compiler can optimise across them
+class TraceEmitter
+{
+private:
+    std::ostream& out;
+
+    // Expressions of the values pushed by the trace, either constants or variable names
+    std::vector<std::string> vstack;
+
+    // Number of variables declared so far
+    int& temps;
+
+    // Whether the interpreter taking over after p knows the list operations
+    bool list_ops;
+
+    std::string pop()
+    {
+        if (!vstack.empty())
+        {
+            std::string e = vstack.back();
+            vstack.pop_back();
+            return e;
+        }
+        return let("Stack::pop()");
+    }
+
+    // Declare a variable holding expr
+    std::string let(const std::string& expr)
+    {
+        std::string t = "t" + std::to_string(temps++);
+        out << "        bef_t " << t << " = " << expr << ";\n";
+        return t;
+    }
+
+    void push(const std::string& e) { vstack.push_back(e); }
+
+    void flush()
+    {
+        for (auto& e : vstack) out << "        Stack::push(" << e << ");\n";
+        vstack.clear();
+    }
+
+    void binary(const char* op)
+    {
+        std::string b = pop();
+        std::string a = pop();
+        push(let(a + " " + op + " " + b));
+    }
+
+    void binary_imm(const char* op, bef_t imm) { push(let(pop() + " " + op + " " + constant(imm))); }
+
+public:
+    TraceEmitter(std::ostream& out, int& temps, bool list_ops) : out(out), temps(temps), list_ops(list_ops) {}
+
+    void emit(const Trace& t);
+};
+
+
+void TraceEmitter::emit(const Trace& t)
+{
+    for (auto& op : t.ops)
+    {
+        switch (op.instr)
+        {
+            case Add:     binary("+"); break;
+            case Sub:     binary("-"); break;
+            case Mul:     binary("*"); break;
+            case Div:     binary("/"); break;
+            case Mod:     binary("%"); break;
+            case Grt:     binary(">"); break;
+            case Add_imm: binary_imm("+", op.imm); break;
+            case Sub_imm: binary_imm("-", op.imm); break;
+            case Mul_imm: binary_imm("*", op.imm); break;
+            case Div_imm: binary_imm("/", op.imm); break;
+            case Mod_imm: binary_imm("%", op.imm); break;
+            case Grt_imm: binary_imm(">", op.imm); break;
+            case Not:     push(let("!" + pop())); break;
+            case Push:    push(constant(op.imm)); break;
+            case Push_str:
+                for (uint32_t k = 0; k < span_count(op.imm); k++) push(constant(t.literals[span_first(op.imm) + k]));
+                break;
+            case Nop:     break;
+            case Dup:
+            {
+                std::string a = pop();
+                push(a);
+                push(a);
+                break;
+            }
+            case Swap:
+            {
+                std::string b = pop();
+                std::string a = pop();
+                push(b);
+                push(a);
+                break;
+            }
+            case Pop:
+                if (!vstack.empty()) vstack.pop_back();
+                else out << "        Stack::pop();\n";
+                break;
+            case Print_int:
+            case Print_char:
+            {
+                // pop may declare a variable, so it has to be written first
+                std::string a = pop();
+                out << "        " << (op.instr == Print_int ? "print_int(" : "print_char(") << a << ");\n";
+                break;
+            }
+            case Get:
+            {
+                std::string y = pop();
+                std::string x = pop();
+                push(let("aot_get(grid, " + x + ", " + y + ")"));
+                break;
+            }
+            case In_int:  push(let("read_int()")); break;
+            case In_char: push(let("read_char()")); break;
+            case Cell:
+                flush();
+                out << "        Heap::cell();\n";
+                break;
+            case Head: push(let("Heap::head(Heap::check_cell(" + pop() + "))")); break;
+            case Tail: push(let("Heap::tail(Heap::check_cell(" + pop() + "))")); break;
+            case Head_cell: push(let("Heap::head(" + pop() + ")")); break;
+            case Tail_cell: push(let("Heap::tail(" + pop() + ")")); break;
+            case List_len: push(let("int2bef(Heap::length(" + pop() + "))")); break;
+            case List_nth:
+            {
+                std::string i = pop();
+                std::string list = pop();
+                push(let("Heap::nth(" + list + ", bef2int(" + i + "))"));
+                break;
+            }
+            case List_rev:
+            case List_build:
+            case List_spill:
+                flush();
+                out << "        Heap::" << (op.instr == List_rev ? "reverse" : op.instr == List_build ? "build" : "spill")
+                    << "();\n";
+                break;
+            case Jump:
+                flush();
+                out << "        goto " << label(t.next) << ";\n";
+                break;
+            case Horif:
+            case Verif:
+            {
+                std::string cond = pop();
+                flush();
+                bool hor = op.instr == Horif;
+                int on_true = dir_index(hor ? Direction::Left : Direction::Up);
+                int on_false = dir_index(hor ? Direction::Right : Direction::Down);
+                out << "        if ((bool) " << cond << ") goto " << label(t.exits[on_true]) << ";\n"
+                    << "        else goto " << label(t.exits[on_false]) << ";\n";
+                break;
+            }
+            case Pc_rand:
+            {
+                flush();
+                // Same order as the interpreter, so that both follow the same path for a given seed
+                static const Direction dirs[] = { Direction::Right, Direction::Left, Direction::Down, Direction::Up };
+                out << "        switch (Random::dir())\n        {\n";
+                for (int k = 0; k < 4; k++)
+                    out << "            " << (k < 3 ? "case " + std::to_string(k) : std::string("default"))
+                        << ": goto " << label(t.exits[dir_index(dirs[k])]) << ";\n";
+                out << "        }\n";
+                break;
+            }
+            case Put:
+            {
+                std::string y = pop();
+                std::string x = pop();
+                std::string v = pop();
+                flush();
+                out << "        if (aot_put(grid, covered, " << v << ", " << x << ", " << y << "))\n"
+                    << "            return interpret(grid, " << t.next << ", false, " << (list_ops ? "true" : "false") << ");\n"
+                    << "        goto " << label(t.next) << ";\n";
+                break;
+            }
+            case End:
+                out << "        return 0;\n";
+                break;
+            case Unk:
+                out << "        Output::flush();\n"
+                    << "        std::cerr << \"Unknown instruction: " << literal(bef2char(op.imm)) << "\" << std::endl;\n"
+                    << "        return 1;\n";
+                break;
+            // Exec operations only appear after p ran
+            default:
+                break;
+        }
+    }
+}
+
+}
+
+
+void emit_cpp(CodeGrid<char>& code, const char* filename, std::ostream& out, bool list_ops)
+{
+    // No labels are needed, the operations are only inspected
+    static void* const labels[Num_instrs] = {};
+    TraceCache traces(code, labels, list_ops);
+
+    // Traces reachable from the start, in the order they were found
+    int start = make_state(Position(0, 0), Direction::Right);
+    std::vector<int> order;
+    std::vector<bool> found(numStates);
+    std::queue<int> pending;
+    std::bitset<gridH * gridW> covered;
+
+    // h and t of the values the facts from the start show to be cells are not checked
+    traces.start(start);
+    pending.push(start);
+    found[start] = true;
+    while (!pending.empty())
+    {
+        int state = pending.front();
+        pending.pop();
+        order.push_back(state);
+
+        Trace* t = traces.get(state);
+        covered |= t->cells;
+
+        std::vector<int> next;
+        switch (t->ops.back().instr)
+        {
+            case Jump:
+            case Put:
+                next.push_back(t->next);
+                break;
+            case Horif:
+                next.push_back(t->exits[dir_index(Direction::Left)]);
+                next.push_back(t->exits[dir_index(Direction::Right)]);
+                break;
+            case Verif:
+                next.push_back(t->exits[dir_index(Direction::Up)]);
+                next.push_back(t->exits[dir_index(Direction::Down)]);
+                break;
+            case Pc_rand:
+                next.assign(t->exits, t->exits + 4);
+                break;
+            default:
+                break;
+        }
+
+        for (int s : next)
+            if (!found[s])
+            {
+                found[s] = true;
+                pending.push(s);
+            }
+    }
+
+    out << "// Generated by befunge93+ --emit-cpp from " << filename << "\n"
+        << "// Build with: c++ -std=c++11 -O3 -pthread -I<befunge93+ sources> <this file> libbefunge.a\n\n"
+        << "#include \"aot.hpp\"\n\n";
+
+    out << "static const char* const rows[gridH] =\n{\n";
+    for (int y = 0; y < gridH; y++)
+    {
+        out << "    \"";
+        for (int x = 0; x < gridW; x++) out << literal(code(y, x));
+        out << "\",\n";
+    }
+    out << "};\n\n";
+
+    out << "// Cells the compiled code depends on\n"
+        << "static const char* const covered[gridH] =\n{\n";
+    for (int y = 0; y < gridH; y++)
+    {
+        out << "    \"";
+        for (int x = 0; x < gridW; x++) out << (covered[Position(y, x).index()] ? '1' : '0');
+        out << "\",\n";
+    }
+    out << "};\n\n";
+
+    out << "int main()\n{\n"
+        << "    Output::install_signal_handlers();\n"
+        << "    Stack::swap(Stack::create(Stack::DEFAULT_SIZE));\n"
+        << "    CodeGrid<char> grid;\n"
+        << "    for (int y = 0; y < gridH; y++)\n"
+        << "        for (int x = 0; x < gridW; x++)\n"
+        << "            grid(y, x) = rows[y][x];\n\n";
+
+    int temps = 0;
+    for (int state : order)
+    {
+        Position pos = state_pos(state);
+        out << label(state) << ": // (" << pos.x() << ", " << pos.y() << ")\n"
+            << "    {\n";
+        TraceEmitter(out, temps, list_ops).emit(*traces.get(state));
+        out << "    }\n";
+    }
+
+    out << "}\n";
+}
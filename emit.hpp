@@ -0,0 +1,10 @@
+#pragma once
+
+#include <ostream>
+
+#include "grid.hpp"
+
+// Writes a C++ translation unit that runs the code, with a label for every reachable trace
+// It is built against libbefunge.a and hands over to the interpreter once p changes compiled code
+// list_ops compiles the list operations of --lists, which are unknown instructions otherwise
+void emit_cpp(CodeGrid<char>& code, const char* filename, std::ostream& out, bool list_ops);
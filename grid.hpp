@@ -0,0 +1,79 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+// Width and height of code grid
+constexpr int gridH = 25, gridW = 80;
+
+// Directions are numbered 0-3 so that a (cell, direction) pair fits in one int
+enum class Direction : int { Right, Down, Left, Up };
+
+inline int dir_index(Direction dir) { return static_cast<int>(dir); }
+
+inline Direction index_dir(int i) { return static_cast<Direction>(i); }
+
+// Class for program counter
+class Position
+{
+private:
+    template<class T>
+    friend class CodeGrid;
+
+    int pos;
+
+public:
+    Position(int y, int x) : pos(y * gridW + x) {}
+
+    static Position from_index(int index) { Position p(0, 0); p.pos = index; return p; }
+
+    int index() const { return pos; }
+
+    int x() const { return pos % gridW; }
+
+    int y() const { return pos / gridW; }
+
+    // Advance one horizontally
+    Position& operator++() { pos++; return *this; }
+
+    // Move one cell towards dir, wrapping around the edges of the grid
+    void step(Direction dir)
+    {
+        int x = pos % gridW, y = pos / gridW;
+        switch (dir)
+        {
+            case Direction::Right: x = (x == gridW - 1) ? 0 : x + 1; break;
+            case Direction::Left:  x = (x == 0) ? gridW - 1 : x - 1; break;
+            case Direction::Down:  y = (y == gridH - 1) ? 0 : y + 1; break;
+            case Direction::Up:    y = (y == 0) ? gridH - 1 : y - 1; break;
+        }
+        pos = y * gridW + x;
+    }
+};
+
+
+// Number of (cell, direction) states of the grid
+constexpr int numStates = gridH * gridW * 4;
+
+inline int make_state(Position pos, Direction dir) { return pos.index() * 4 + dir_index(dir); }
+
+inline Position state_pos(int state) { return Position::from_index(state / 4); }
+
+inline Direction state_dir(int state) { return index_dir(state % 4); }
+
+
+// Type of code grid
+template<class T>
+class CodeGrid
+{
+private:
+    std::array<T, gridH * gridW> code;
+
+public:
+    // True if (y, x) is a cell of the grid, for coordinates coming from the program
+    static bool inside(int64_t y, int64_t x) { return y >= 0 && y < gridH && x >= 0 && x < gridW; }
+
+    T& operator()(int y, int x) { return code[y * gridW + x]; }
+
+    T& operator()(const Position& pos) { return code[pos.pos]; }
+};
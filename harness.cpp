@@ -0,0 +1,74 @@
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#include <dirent.h>
+
+#include "harness.hpp"
+
+
+Vm::Options options_of(const Mode& mode)
+{
+    Vm::Options options;
+    options.jit = mode.jit;
+    options.generational = mode.generational;
+    options.list_ops = mode.list_ops;
+    options.mark_work = mode.mark_work;
+    options.mark_slice_ns = mode.mark_slice_ns;
+    return options;
+}
+
+
+bool runs_in(const Program& p, const Mode& mode)
+{
+    return !p.list_ops || mode.list_ops;
+}
+
+
+bool read_file(const std::string& path, std::string& contents)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (file.fail()) return false;
+
+    std::stringstream s;
+    s << file.rdbuf();
+    contents = s.str();
+    return true;
+}
+
+
+std::vector<Program> load_programs(const std::string& dir)
+{
+    std::vector<std::string> names;
+    if (DIR* d = opendir(dir.c_str()))
+    {
+        while (dirent* e = readdir(d))
+        {
+            std::string name = e->d_name;
+            if (name.size() > 3 && name.compare(name.size() - 3, 3, ".bf") == 0) names.push_back(name.substr(0, name.size() - 3));
+        }
+        closedir(d);
+    }
+    std::sort(names.begin(), names.end());
+
+    std::vector<Program> programs;
+    for (const std::string& name : names)
+    {
+        Program p;
+        p.name = name;
+        std::string base = dir + "/" + name;
+        p.path = base + ".bf";
+        if (!read_file(p.path, p.code)) continue;
+        if (!read_file(base + ".out", p.expected))
+        {
+            std::fprintf(stderr, "%s: no %s.out, skipped\n", name.c_str(), base.c_str());
+            continue;
+        }
+        read_file(base + ".in", p.input);
+        if (read_file(base + ".err", p.error) && !p.error.empty() && p.error.back() == '\n') p.error.pop_back();
+        p.list_ops = name.compare(0, 5, "lists") == 0;
+        programs.push_back(p);
+    }
+    return programs;
+}
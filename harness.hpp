@@ -0,0 +1,66 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "vm.hpp"
+
+// What befunge93-check and befunge93-bench share: the modes the programs are run in, and the loading of
+// the programs of a directory
+
+// Options of the Vms a program is run with
+struct Mode
+{
+    const char* name;
+    bool jit;
+    bool generational;
+
+    // Only the modes with list operations run the programs using them, see Program
+    bool list_ops;
+
+    // Budget of the slices of incremental marking, see Vm::Options
+    size_t mark_work;
+    uint64_t mark_slice_ns;
+};
+
+const Mode modes[] =
+{
+    {"interp", false, false, false, 0, 0},
+    {"jit", true, false, false, 0, 0},
+    {"gen", false, true, false, 0, 0},
+    {"gen-jit", true, true, false, 0, 0},
+    {"incr", false, false, false, 1, 0},
+    {"incr-us", false, true, false, 0, 20000},
+    {"lists", false, false, true, 0, 0},
+    {"lists-jit", true, false, true, 0, 0}
+};
+
+// A .bf file of a directory, with the output it has to give
+struct Program
+{
+    std::string name;
+    std::string path;
+    std::string code;
+
+    // The .in file, fed to the program as its input
+    std::string input;
+
+    // The .out file
+    std::string expected;
+
+    // The .err file, the message the program has to fail with, empty if it has to end with @
+    std::string error;
+
+    // True if the program uses the list operations, which is told by a name starting with lists
+    bool list_ops;
+};
+
+Vm::Options options_of(const Mode& mode);
+
+// True if the program is run in the mode
+bool runs_in(const Program& p, const Mode& mode);
+
+bool read_file(const std::string& path, std::string& contents);
+
+// The programs of dir in the order of their names, those with no .out file are left out
+std::vector<Program> load_programs(const std::string& dir);
@@ -1,121 +1,606 @@
+#include <algorithm>
+#include <sys/mman.h>
+
 #include "heap.hpp"
 #include "stack.hpp"
+#include "trap.hpp"
+#include "stats.hpp"
 
 // Initialization of static member variables
-block Heap::heap[Heap::HEAP_SIZE];
+constexpr size_t Heap::GROW_CHUNK;
+
+constexpr size_t Heap::NURSERY_SIZE;
+
+__thread size_t Heap::max_blocks = Heap::DEFAULT_SIZE / sizeof(block);
+
+__thread bool Heap::huge_pages = false;
+
+__thread block* Heap::heap = nullptr;
+
+__thread block* Heap::old_begin = nullptr;
+
+__thread block* Heap::old_end = nullptr;
+
+__thread block* Heap::heap_end = nullptr;
+
+__thread uint64_t Heap::free_bits = 0;
+
+__thread block* Heap::free_base = nullptr;
+
+__thread size_t Heap::free_blocks = 0;
+
+__thread size_t Heap::live_blocks = 0;
+
+__thread block* Heap::nursery_top = nullptr;
+
+__thread block** Heap::pending = nullptr;
+
+__thread uint64_t* Heap::live = nullptr;
+
+__thread block* Heap::sweeper = nullptr;
+
+__thread void (*Heap::pause_hook)(uint64_t) = nullptr;
+
+__thread size_t Heap::mark_work = 0;
+
+__thread uint64_t Heap::slice_ns = 0;
+
+__thread bool Heap::marking = false;
+
+__thread bool Heap::step_due = false;
+
+__thread uint64_t* Heap::marks = nullptr;
+
+__thread block** Heap::mark_stack = nullptr;
+
+__thread size_t Heap::mark_top = 0;
+
+__thread size_t Heap::live_marked = 0;
+
+__thread uint64_t Heap::cycle_ns = 0;
 
-block* Heap::free_list = heap;
 
-block* const Heap::marked_null = (block*) (((int64_t) nullptr) | 0b10);
+static void out_of_memory()
+{
+    Trap::raise(Fault::Out_of_memory);
+
+    Output::flush();
+    std::cout << "Not enough memmory\n";
+    exit(1);
+}
+
+
+void Heap::not_a_cell()
+{
+    Trap::raise(Fault::Not_a_cell);
+
+    Output::flush();
+    std::cerr << "Head or tail of an integer" << std::endl;
+    exit(1);
+}
+
+
+// Address space of n bytes, whose pages are only committed once they are touched
+static void* reserve_pages(size_t n, bool huge)
+{
+    void* p = mmap(nullptr, n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) out_of_memory();
+
+    if (huge) madvise(p, n, MADV_HUGEPAGE);
+    return p;
+}
 
-bool Heap::run_gc_once = false;
 
+Heap::State Heap::create(size_t bytes, bool huge)
+{
+    State s = {};
+    s.max_blocks = std::max<size_t>(bytes / sizeof(block) / 64 * 64, 64 * 64);
+#ifdef BEF_COMPACT_HEAP
+    // References hold the index of a block plus one in 29 bits
+    s.max_blocks = std::min<size_t>(s.max_blocks, (1 << 29) - 64);
+#endif
+    s.huge_pages = huge;
+    return s;
+}
+
+
+void Heap::destroy(const State& s)
+{
+    if (!s.heap) return;
+
+    munmap(s.heap, s.max_blocks * sizeof(block));
+    munmap(s.live, s.max_blocks / 8);
+    if (s.pending) munmap(s.pending, (s.old_begin - s.heap) * sizeof(block*));
+    if (s.marks) munmap(s.marks, s.max_blocks / 8);
+    if (s.mark_stack) munmap(s.mark_stack, s.max_blocks * sizeof(block*));
+}
+
+
+Heap::State Heap::swap(const State& s)
+{
+    State old =
+    {
+        max_blocks, huge_pages, heap, old_begin, old_end, heap_end, free_bits,
+        free_base, free_blocks, live_blocks, nursery_top, pending, live, sweeper,
+        mark_work, slice_ns, marking, step_due, marks, mark_stack, mark_top, live_marked, cycle_ns
+    };
+
+    max_blocks = s.max_blocks;
+    huge_pages = s.huge_pages;
+    heap = s.heap;
+    old_begin = s.old_begin;
+    old_end = s.old_end;
+    heap_end = s.heap_end;
+    free_bits = s.free_bits;
+    free_base = s.free_base;
+    free_blocks = s.free_blocks;
+    live_blocks = s.live_blocks;
+    nursery_top = s.nursery_top;
+    pending = s.pending;
+    live = s.live;
+    sweeper = s.sweeper;
+    mark_work = s.mark_work;
+    slice_ns = s.slice_ns;
+    marking = s.marking;
+    step_due = s.step_due;
+    marks = s.marks;
+    mark_stack = s.mark_stack;
+    mark_top = s.mark_top;
+    live_marked = s.live_marked;
+    cycle_ns = s.cycle_ns;
+    return old;
+}
 
-// Mark and sweep garbage collection with in-place stack
+
+void Heap::map(size_t nursery)
+{
+    heap = (block*) reserve_pages(max_blocks * sizeof(block), huge_pages);
+    live = (uint64_t*) reserve_pages(max_blocks / 8, huge_pages);
+    heap_end = heap + max_blocks;
+    if (nursery) pending = (block**) reserve_pages(nursery * sizeof(block*), false);
+    if (mark_work || slice_ns)
+    {
+        marks = (uint64_t*) reserve_pages(max_blocks / 8, huge_pages);
+        mark_stack = (block**) reserve_pages(max_blocks * sizeof(block*), false);
+    }
+
+    old_begin = old_end = free_base = sweeper = heap + nursery;
+    free_blocks = 0;
+    if (!grow()) out_of_memory();
+}
+
+
+bool Heap::grow()
+{
+    size_t n = std::min<size_t>(GROW_CHUNK, heap_end - old_end);
+    if (n == 0) return false;
+
+    // The new blocks have never been used, so their words of live are clear
+    old_end += n;
+    free_blocks += n;
+    return true;
+}
+
+
+// Mark phase with in-place stack
 void Heap::collect_garbage()
 {
-    // Mark phase
+    STATS(uint64_t start = Stats::now());
+
+    // The words the sweep has not reached yet still hold the previous marks
+    std::fill(live + (sweeper - heap) / 64, live + (old_end - heap) / 64, 0);
+
     for(bef_t* s = Stack::sp; s >= Stack::stack; s--)
     {
-        if (is_ptr(*s))
+        if (s > Stack::stack && is_ptr(s[-1])) __builtin_prefetch(s[-1].ptr);
+
+        if (is_ptr(*s) && !is_live(s->ptr))
         {
-            mark(*s);
-            block_ptr prev = marked_null;
-            block_ptr cur = s->ptr;
-            block_ptr temp;
-            mark(cur->head);
+            block* prev = nullptr;
+            block* cur = s->ptr;
+            block* temp;
+            visit(cur);
 
             while(true)
             {
-                // If head is a poiter and the pointed block is not marked
-                if (is_ptr(cur->head) && !is_marked(block_ptr(cur->head.ptr)->head))
+                // If head points to a block that is not marked
+                if ((temp = cell_of(cur->head)) && !is_live(temp))
                 {
                     // Build stack in-place
-                    temp = cur->head.ptr;
-                    cur->head.ptr = prev;
+                    cur->head = link(prev);
                     prev = cur;
                     cur = temp;
 
-                    mark(cur->head);
+                    visit(cur);
                 }
-                // If tail is a poiter and the pointed block is not marked
-                else if (is_ptr(cur->tail) && !is_marked(block_ptr(cur->tail.ptr)->head))
+                // If tail points to a block that is not marked
+                else if ((temp = cell_of(cur->tail)) && !is_live(temp))
                 {
-                    // Mark tail to indicate that it has also been traversed
-                    mark(cur->tail);
-
                     // Build stack in-place
-                    temp = cur->tail.ptr;
-                    cur->tail.ptr = prev;
+                    cur->tail = link(prev);
+                    // Mark tail to indicate that it was followed
+                    mark(cur->tail);
                     prev = cur;
                     cur = temp;
-                    
-                    mark(cur->head);
+
+                    visit(cur);
                 }
                 // Else, pop a block off the stack
                 else
                 {
                     temp = cur;
                     cur = prev;
-                    if (cur == marked_null) break;
+                    if (!cur) break;
 
                     // prev is updated depending on whether head or tail was followed last
                     if (!is_marked(cur->tail))
                     {
-                        prev = cur->head.ptr;
-                        cur->head.ptr = temp;
+                        prev = unlink(cur->head);
+                        cur->head = cell_ref(temp);
                     }
                     else
                     {
-                        prev = cur->tail.ptr;
-                        cur->tail.ptr = temp;
+                        prev = unlink(cur->tail);
+                        cur->tail = cell_ref(temp);
                     }   
                 }
             }
+        }
+    }
+
+    // The free blocks left in the word being allocated from are unmarked, so the sweep finds them again
+    free_bits = 0;
+    sweeper = old_begin;
 
-            unmark(*s);
+    live_blocks = 0;
+    for (uint64_t* w = live + (old_begin - heap) / 64; w < live + (old_end - heap) / 64; w++)
+        live_blocks += __builtin_popcountll(*w);
+    free_blocks = (old_end - old_begin) - live_blocks;
+
+    // The nursery is not swept, its marks are dropped right away
+    std::fill(live, live + (old_begin - heap) / 64, 0);
+
+    STATS(Stats::mark(Stats::now() - start, live_blocks, free_blocks, old_end - old_begin));
+}
+
+
+void Heap::sweep()
+{
+    // Not while a nursery is copied, whose blocks are marked in live meanwhile
+    if ((mark_work || slice_ns) && !nursery_top) step_due = true;
+
+    STATS(uint64_t start = Stats::now());
+
+    while (!free_bits)
+    {
+        if (sweeper == old_end)
+        {
+            // The collection this may start is timed apart
+            STATS(Stats::sweep(Stats::now() - start));
+            reserve(1);
+            STATS(start = Stats::now());
         }
+
+        uint64_t* w = live + (sweeper - heap) / 64;
+        free_bits = ~*w;
+        *w = 0;
+        free_base = sweeper;
+        sweeper += 64;
+
+        // Allocated during an incremental collection, so live until the next one
+        if (marking)
+        {
+            marks[w - live] |= free_bits;
+            live_marked += __builtin_popcountll(free_bits);
+        }
+    }
+
+    STATS(Stats::sweep(Stats::now() - start));
+}
+
+
+void Heap::reserve(size_t n)
+{
+    if (free_blocks >= n) return;
+    if (!heap) map(0);
+
+    // Growing is the short pause
+    if (marking)
+    {
+        while (free_blocks < n && grow());
+        if (free_blocks >= n) return;
+
+        uint64_t start = pause_hook && !nursery_top ? Stats::now() : 0;
+        finish_marking();
+        if (start) pause_hook(Stats::now() - start);
+    }
+
+    if (crowded())
+        while ((crowded() || free_blocks < n) && grow());
+
+    if (free_blocks < n)
+    {
+        // With a nursery, the pause is timed by collect_nursery, the only caller then
+        uint64_t start = pause_hook && !nursery_top ? Stats::now() : 0;
+        collect_garbage();
+        if (start) pause_hook(Stats::now() - start);
+
+        while (free_blocks < n && grow());
     }
 
-    // Sweep phase
-    for(block* b = heap; b < heap + HEAP_SIZE; b++)
+    if (free_blocks < n) out_of_memory();
+}
+
+
+void Heap::reserve_old(size_t n)
+{
+#ifdef BEF_COMPACT_HEAP
+    // Two boxes at most for every cell
+    n *= 3;
+#endif
+    reserve(n);
+}
+
+
+void Heap::use_incremental(size_t work, uint64_t ns)
+{
+    mark_work = work;
+    slice_ns = ns;
+}
+
+
+void Heap::start_marking()
+{
+    uint64_t start = Stats::now();
+    marking = true;
+    live_marked = 0;
+
+    // The rest of the word being allocated from is allocated during the collection
+    if (free_bits)
     {
-        // If block is marked, umark it
-        if (is_marked(b->head))
+        marks[(free_base - heap) / 64] |= free_bits;
+        live_marked += __builtin_popcountll(free_bits);
+    }
+
+    for (bef_t* s = Stack::stack; s <= Stack::sp; s++)
+        if (is_ptr(*s)) shade(s->ptr);
+
+    cycle_ns = Stats::now() - start;
+    if (pause_hook) pause_hook(cycle_ns);
+}
+
+
+void Heap::mark_slice(size_t work)
+{
+    uint64_t start = Stats::now();
+
+    // The clock is only read every 64 blocks
+    while (mark_top > 0 && work > 0)
+    {
+        for (size_t n = std::min<size_t>(work, 64); n > 0 && mark_top > 0; n--)
         {
-            unmark(b->head);
-            unmark(b->tail);
+            block* b = mark_stack[--mark_top];
+            shade(b->head);
+            shade(b->tail);
         }
-        // Else add it to the free list
-        else
+        work -= std::min<size_t>(work, 64);
+
+        if (slice_ns && Stats::now() - start >= slice_ns) break;
+    }
+    if (mark_top == 0) finish_marking();
+
+    uint64_t ns = Stats::now() - start;
+    cycle_ns += ns;
+    if (pause_hook) pause_hook(ns);
+}
+
+
+void Heap::finish_marking()
+{
+    STATS(uint64_t start = Stats::now());
+
+    while (mark_top > 0)
+    {
+        block* b = mark_stack[--mark_top];
+        shade(b->head);
+        shade(b->tail);
+    }
+
+    // The words the sweep has not reached yet still hold the previous marks, which are cleared
+    // for the next collection
+    std::fill(live + (sweeper - heap) / 64, live + (old_end - heap) / 64, 0);
+    std::swap(live, marks);
+    sweeper = old_begin;
+    marking = false;
+
+    // The word being allocated from is marked, but what is left of it is still free
+    size_t left = __builtin_popcountll(free_bits);
+    live_blocks = live_marked - left;
+    free_blocks = (old_end - old_begin) - live_marked + left;
+
+    STATS(Stats::mark(cycle_ns + Stats::now() - start, live_blocks, free_blocks, old_end - old_begin));
+
+    while (crowded() && grow());
+}
+
+
+void Heap::step(size_t allocated)
+{
+    size_t size = old_end - old_begin;
+    if (!marking)
+    {
+        // Once half the blocks the last collection left free are gone
+        if (free_blocks * 2 < size - live_blocks) start_marking();
+        return;
+    }
+
+    // Enough to scan the blocks left, guessed from the last collection, before the free blocks run out
+    // at this rate of allocation, with a margin of two
+    size_t left = live_blocks > live_marked ? live_blocks - live_marked : 0;
+    size_t pace = 2 * (left + mark_top) * allocated / std::max<size_t>(free_blocks, 64);
+    mark_slice(std::max(std::max(mark_work, pace), allocated));
+}
+
+
+void Heap::use_nursery()
+{
+    // The nursery takes at most a quarter of the heap
+    map(std::min<size_t>(NURSERY_SIZE, max_blocks / 4 / 64 * 64));
+    nursery_top = heap;
+}
+
+
+block* Heap::copy(block* b, bool has_fields, size_t& n)
+{
+    if (is_live(b)) return unlink(b->head);
+
+    block* c = alloc_old();
+    *c = *b;
+    set_live(b);
+    b->head = link(c);
+    if (has_fields) pending[n++] = c;
+
+    return c;
+}
+
+
+void Heap::forward(ref_t& r, size_t& n)
+{
+    if (block* b = cell_of(r))
+    {
+        if (b < old_begin) r = cell_ref(copy(b, true, n));
+    }
+    else if (block* b = box_of(r))
+    {
+        if (b < old_begin) r = box_ref(copy(b, false, n));
+    }
+}
+
+
+void Heap::collect_nursery()
+{
+    uint64_t start = pause_hook ? Stats::now() : 0;
+
+    // Everything may survive, so the room is made before anything is copied
+    reserve(nursery_top - heap);
+    size_t free_before = free_blocks;
+    STATS(uint64_t copying = Stats::now());
+
+    size_t n = 0;
+    for(bef_t* s = Stack::sp; s >= Stack::stack; s--)
+    {
+        if (is_ptr(*s) && s->ptr < old_begin) s->ptr = copy(s->ptr, true, n);
+
+        // The fields of the copies are forwarded depth first
+        while (n > 0)
         {
-            b->head.ptr = free_list;
-            free_list = b;
+            block* b = pending[--n];
+            forward(b->head, n);
+            forward(b->tail, n);
         }
     }
 
-    // If free_list points to the end of the heap, then no memory was freed
-    if (free_list == heap + HEAP_SIZE)
+    // The marks of the copied blocks
+    std::fill(live, live + (old_begin - heap) / 64, 0);
+    nursery_top = heap;
+
+    STATS(Stats::nursery(Stats::now() - copying));
+    if (start) pause_hook(Stats::now() - start);
+
+    // The only time the nursery is empty, the copies are the allocations of the old space
+    if (mark_work || slice_ns) step(free_before - free_blocks);
+}
+
+
+int64_t Heap::length(bef_t list)
+{
+    int64_t n = 0;
+    for (; is_ptr(list); n++) list = tail(list);
+    return n;
+}
+
+
+bef_t Heap::nth(bef_t list, int64_t i)
+{
+    if (i < 0) return int2bef(0);
+
+    for (; i > 0 && is_ptr(list); i--) list = tail(list);
+    return is_ptr(list) ? head(list) : int2bef(0);
+}
+
+
+void Heap::reverse()
+{
+    safe_point();
+
+    bef_t list = Stack::pop();
+    bef_t end = list;
+    while (is_ptr(end)) end = tail(end);
+
+    // The rest of the list and the reversed part so far stay on the stack, since alloc may move them
+    Stack::push(list);
+    Stack::push(end);
+    while (is_ptr(Stack::sp[-1]))
     {
-        std::cout << "Not enough memmory\n";
-        exit(1);
+#ifdef BEF_COMPACT_HEAP
+        // A box for the value the list ends with
+        ensure(2);
+#endif
+
+        block* b = alloc();
+        block* rest = Stack::sp[-1].ptr;
+        b->head = rest->head;
+        b->tail = to_ref(Stack::sp[0]);
+        Stack::sp[-1] = from_ref(rest->tail);
+        Stack::sp[0] = bef_t{.ptr = b};
     }
+
+    bef_t reversed = Stack::pop();
+    Stack::pop();
+    Stack::push(reversed);
 }
 
+
+void Heap::build()
+{
+    int64_t n = bef2int(Stack::pop());
+
+    Stack::push(int2bef(0));
+    for (int64_t k = 0; k < n; k++) cell();
+}
+
+
+void Heap::spill()
+{
+    bef_t list = Stack::pop();
+
+    // Nothing is allocated, so list stays put
+    int64_t n = 0;
+    for (; is_ptr(list); n++)
+    {
+        Stack::push(head(list));
+        list = tail(list);
+    }
+    Stack::push(int2bef(n));
+}
+
+
 void Heap::printHeap()
 {
-    for(block* b = heap; b < heap + HEAP_SIZE; b++)
+    for(block* b = heap; b < old_end; b++)
     {
-        std::cout << b - heap << ':' << std::endl;
+        std::cout << b - heap << ": live: " << is_live(b) << std::endl;
+
+        bef_t head = from_ref(b->head), tail = from_ref(b->tail);
 
         std::cout << "\thead:" << ": ";
-        if (is_ptr(b->head)) std::cout << "ptr: " << b->head.ptr - heap;
-        else std::cout << (b->head.i>>2);
-        std::cout << " marked: " << is_marked(b->head) << std::endl;
+        if (is_ptr(head)) std::cout << "ptr: " << head.ptr - heap;
+        else std::cout << (head.i>>2);
+        std::cout << std::endl;
         
         std::cout << "\ttail:" << ": ";
-        if (is_ptr(b->tail)) std::cout << "ptr: " << b->tail.ptr - heap;
-        else std::cout << (b->tail.i>>2);
-        std::cout << " marked: " << is_marked(b->tail) << std::endl;
+        if (is_ptr(tail)) std::cout << "ptr: " << tail.ptr - heap;
+        else std::cout << (tail.i>>2);
+        std::cout << std::endl;
     }
 }
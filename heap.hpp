@@ -1,69 +1,435 @@
 #pragma once
 
+#include <cstring>
+
 #include "bef_type.hpp"
+#include "stack.hpp"
 
 //Singleton class for Heap operations
+//Every thread has a heap of its own
+//The fields of blocks are the values themselves, or with BEF_COMPACT_HEAP defined, 32-bit references
+//that are either integers of 31 bits or indices of blocks, so that a block takes 8 bytes instead of 16
 class Heap
 {
 private:
-    static constexpr size_t HEAP_SIZE = ((1<<24) * sizeof(int64_t)) / sizeof(block);
+    // Number of blocks the old space starts with and grows by
+    static constexpr size_t GROW_CHUNK = 1 << 21;
+
+    // Percentage of the old space the live blocks may take after a collection before it grows
+    static constexpr size_t LIVE_TARGET = 25;
+
+    // Largest number of blocks at the start of the heap used as nursery by the generational mode
+    static constexpr size_t NURSERY_SIZE = 1 << 18;
+
+    // Limit of the heap in blocks, and whether it asks for transparent huge pages
+    static __thread size_t max_blocks;
+    static __thread bool huge_pages;
+
+    // Reserved address space, nullptr until the first allocation
+    static __thread block* heap;
+
+    // The nursery, if any, comes first, then the old space, which grows up to the end of the reservation
+    static __thread block* old_begin;
+    static __thread block* old_end;
+    static __thread block* heap_end;
+
+    // Free blocks of the word of live being allocated from, one bit each, and the block of bit 0
+    static __thread uint64_t free_bits;
+    static __thread block* free_base;
+
+    // Number of free blocks of the old space, swept or not
+    static __thread size_t free_blocks;
+
+    // Number of blocks the last collection found live in the old space
+    static __thread size_t live_blocks;
+
+    // Next block of the nursery, the nursery is not used while it is nullptr
+    static __thread block* nursery_top;
+
+    // Copies of nursery blocks whose fields have not been forwarded yet, room for the whole nursery
+    static __thread block** pending;
+
+    // One bit per block, set for the blocks the last collection found live
+    // The marks are kept outside the blocks, since blocks that have not been swept yet are still in use
+    // The sweep clears the words it passes, so that they are clear for the next collection
+    static __thread uint64_t* live;
+
+    // First block of the next word of live to sweep
+    static __thread block* sweeper;
+
+    // Called with the length of every collection, see set_pause_hook
+    static __thread void (*pause_hook)(uint64_t ns);
+
+    // Budget of a slice of incremental marking, in blocks and in nanoseconds, both 0 when the whole
+    // mark phase runs at once, see use_incremental
+    static __thread size_t mark_work;
+    static __thread uint64_t slice_ns;
 
-    static block heap[HEAP_SIZE];
+    // Whether an incremental collection is in progress
+    static __thread bool marking;
 
-    static block* free_list;
+    // Set by the sweep when the next step of incremental marking is due, see safe_point
+    static __thread bool step_due;
 
-    // Null pointer with its 2nd lsb marked, needed for garbage collection
-    static block* const marked_null;
+    // Marks of the collection in progress, kept apart from live, which the sweep still needs
+    // The two are swapped once the marking is done
+    static __thread uint64_t* marks;
 
-    // True if the GC has run once
-    static bool run_gc_once;
-    
-    // The following class overrides the operator->
-    // Because of the marking dereferencing a pointer needs
-    // to ignore last 2 bits
-    struct block_ptr
+    // Blocks that are marked but whose fields have not been marked yet, room for the whole heap
+    // since a block is pushed at most once by a collection
+    static __thread block** mark_stack;
+    static __thread size_t mark_top;
+
+    // Number of blocks marked by the collection in progress, and the time its slices took
+    static __thread size_t live_marked;
+    static __thread uint64_t cycle_ns;
+
+#ifdef BEF_COMPACT_HEAP
+    // A reference is either an integer i as (i << 1) | 1, or the index of a block shifted by 3
+    // Bit 2 is set for boxes, blocks holding an integer that does not fit in a reference
+    static constexpr ref_t BOX = 0b100;
+
+    static block* cell_of(ref_t r) { return (r & 0b101) == 0 ? heap + (r >> 3) : nullptr; }
+
+    static block* box_of(ref_t r) { return (r & 0b101) == BOX ? heap + (r >> 3) : nullptr; }
+
+    static ref_t cell_ref(block* b) { return (ref_t) (b - heap) << 3; }
+
+    static ref_t box_ref(block* b) { return cell_ref(b) | BOX; }
+
+    // Links of the mark phase, which also encode no block
+    static ref_t link(block* b) { return b ? cell_ref(b + 1) : 0; }
+
+    static block* unlink(ref_t r) { return (r >> 3) ? heap + (r >> 3) - 1 : nullptr; }
+
+    static ref_t to_ref(bef_t v)
     {
-        block* ptr;
+        if (is_ptr(v)) return cell_ref(v.ptr);
 
-        block_ptr(block* ptr = marked_null) : ptr(ptr) {}
-        
-        // Return the equivalent unmarked pointer
-        block* operator->() { return (block*) (((int64_t) ptr) & ~0b11); }
+        int64_t i = bef2int(v);
+        if (i >= -(1 << 30) && i < (1 << 30)) return (ref_t) ((uint64_t) i << 1) | 1;
 
-        // Needed so block_ptr can be assigned to block*
-        operator block*() { return ptr; }
-    };
+        block* box = alloc();
+        std::memcpy(box, &i, sizeof(i));
+        return box_ref(box);
+    }
 
-    static void mark(bef_t& b) { b.i |= 0b10; }
+    // to_ref taking boxes from the old space
+    static ref_t old_ref(bef_t v)
+    {
+        if (is_ptr(v)) return cell_ref(v.ptr);
+
+        int64_t i = bef2int(v);
+        if (i >= -(1 << 30) && i < (1 << 30)) return (ref_t) ((uint64_t) i << 1) | 1;
+
+        block* box = alloc_old();
+        std::memcpy(box, &i, sizeof(i));
+        return box_ref(box);
+    }
+
+    static bef_t from_ref(ref_t r)
+    {
+        if (r & 1) return int2bef((int32_t) r >> 1);
+
+        block* b = heap + (r >> 3);
+        if (!(r & BOX)) return bef_t{.ptr = b};
+
+        int64_t i;
+        std::memcpy(&i, b, sizeof(i));
+        return int2bef(i);
+    }
+
+    // The tail of a block is marked while the mark phase follows it
+    // Bit 1 is part of integers, so only links count as marked
+    static void mark(ref_t& r) { r |= 0b10; }
+
+    static bool is_marked(ref_t r) { return (r & 0b11) == 0b10; }
+#else
+    static block* cell_of(ref_t r) { return is_ptr(r) ? r.ptr : nullptr; }
+
+    static block* box_of(ref_t) { return nullptr; }
+
+    static ref_t cell_ref(block* b) { return bef_t{.ptr = b}; }
+
+    static ref_t box_ref(block* b) { return cell_ref(b); }
+
+    // Links of the mark phase
+    static ref_t link(block* b) { return bef_t{.ptr = b}; }
+
+    static block* unlink(ref_t r) { return (block*) (r.i & ~0b10); }
+
+    static ref_t to_ref(bef_t v) { return v; }
+
+    static ref_t old_ref(bef_t v) { return v; }
 
-    static void unmark(bef_t& b) { b.i &= ~0b10; }
+    static bef_t from_ref(ref_t r) { return r; }
+
+    // The tail of a block is marked while the mark phase follows it
+    static void mark(bef_t& b) { b.i |= 0b10; }
 
     static bool is_marked(bef_t b) { return b.i & 0b10; }
+#endif
+
+    static bool is_live(block* b) { size_t i = b - heap; return live[i / 64] & (1ull << (i % 64)); }
+
+    static void set_live(block* b) { size_t i = b - heap; live[i / 64] |= 1ull << (i % 64); }
+
+    // Marks b and its boxes, and fetches the blocks it points to, which the mark phase visits soon
+    static void visit(block* b)
+    {
+        set_live(b);
+        if (block* c = cell_of(b->head)) __builtin_prefetch(c);
+        else if (block* box = box_of(b->head)) set_live(box);
+        if (block* c = cell_of(b->tail)) __builtin_prefetch(c);
+        else if (block* box = box_of(b->tail)) set_live(box);
+    }
+
+    static bool has_mark(block* b) { size_t i = b - heap; return marks[i / 64] & (1ull << (i % 64)); }
+
+    // Marks an unmarked block and pushes it to be scanned
+    static void shade(block* b)
+    {
+        if (has_mark(b)) return;
+
+        size_t i = b - heap;
+        marks[i / 64] |= 1ull << (i % 64);
+        live_marked++;
+        mark_stack[mark_top++] = b;
+        __builtin_prefetch(b);
+    }
+
+    // Marks the block r points to, boxes right away since they have no fields
+    static void shade(ref_t r)
+    {
+        if (block* c = cell_of(r)) shade(c);
+        else if (block* box = box_of(r))
+        {
+            if (has_mark(box)) return;
 
+            size_t i = box - heap;
+            marks[i / 64] |= 1ull << (i % 64);
+            live_marked++;
+        }
+    }
+
+    // An incremental collection marks what the stack reaches when it starts, and every block allocated
+    // until it is done, which are taken from words of live that are not swept yet and are marked as
+    // a whole when the sweep reaches them
+    // Cells are never changed after they are made, so a block reachable later was either reachable
+    // at the start or allocated since, and no barrier is needed
+    // It only starts and runs while the nursery, if any, is empty, so that the stack holds old blocks
+    // It must start where the stack holds every value in use, see safe_point
+    static void start_marking();
+
+    // Scans blocks of the mark stack, at least work of them unless the stack runs out first,
+    // and within slice_ns if set, then finishes the collection once the stack is empty
+    static void mark_slice(size_t work);
+
+    // Scans what is left of the mark stack, then makes the marks those the sweep follows
+    static void finish_marking();
+
+    // Runs the next slice of an incremental collection, or starts one once the free blocks run low
+    static void step(size_t allocated);
+
+    // Runs the step due every 64 allocations or so of the old space
+    // Called before allocating, while the values in use are all on the stack
+    static void safe_point()
+    {
+        if (!step_due) return;
+        step_due = false;
+        step(64);
+    }
+
+    // Mark phase of the old space, the sweep is done by sweep as the blocks are needed
+    // Blocks are marked in the nursery as well, since they may be the only ones pointing to old blocks
     static void collect_garbage();
 
-public:
-    Heap() = delete;
+    // Sweeps the words of live until one has a free block, collecting garbage when the whole old space has been swept
+    // Dead blocks are never touched, they are found from their clear bit
+    static void sweep();
+
+    // Reserves the address space of the heap, with the given number of blocks as nursery
+    static void map(size_t nursery);
+
+    // Whether the last collection found more live blocks than the target allows
+    static bool crowded() { return live_blocks * 100 > LIVE_TARGET * (size_t) (old_end - old_begin); }
+
+    // Adds a chunk of free blocks to the end of the old space, returns false at the limit
+    static bool grow();
+
+    // Makes sure n blocks are free in the old space
+    // A crowded old space grows first, and garbage is only collected if that is not enough
+    // An incremental collection is only finished at once if growing is not enough either
+    static void reserve(size_t n);
+
+    // Allocation in the old space
+    // The old space starts out free, with no marks, so the first blocks come from the sweep as well
+    static block* alloc_old()
+    {
+        if (!free_bits) sweep();
+
+        block* b = free_base + __builtin_ctzll(free_bits);
+        free_bits &= free_bits - 1;
+        free_blocks--;
+
+        return b;
+    }
+
+    // Makes sure the next n allocations do not collect garbage
+    static void ensure(size_t n)
+    {
+        if (!nursery_top) { if (free_blocks < n) reserve(n); }
+        else if ((size_t) (old_begin - nursery_top) < n) collect_nursery();
+    }
+
+    // Copy of nursery block b in the old space, made the first time b is reached
+    // A copied block is marked live and holds a link to its copy in its head
+    static block* copy(block* b, bool has_fields, size_t& n);
+
+    // Moves a reference to the nursery to the copy of the block in the old space
+    static void forward(ref_t& r, size_t& n);
+
+    // Copies the live blocks of the nursery to the old space
+    // Cells are never changed after they are made, so old blocks cannot point to the nursery
+    // and the stack is the only root
+    static void collect_nursery();
 
-    // The blocks are of fixed size 2 * sizeof(bef_t) = 2 * sizeof(int64_t)
-    // so just get the first block available
     static block* alloc()
     {
-        // If free_list points to the end of the heap, then run the GC
-        if (free_list == heap + HEAP_SIZE)
+        if (nursery_top)
         {
-            collect_garbage();
-            run_gc_once = true;
+            if (nursery_top == old_begin) collect_nursery();
+            return nursery_top++;
         }
 
-        block* prev = free_list;
+        return alloc_old();
+    }
+
+public:
+    Heap() = delete;
+
+    // Default limit of the heap in bytes, the 128M of the fixed heap of the original, only the pages in use are committed
+    static constexpr size_t DEFAULT_SIZE = (size_t(1) << 24) * sizeof(int64_t);
+
+    // The variables of a heap, so that several heaps can take turns, see Vm
+    struct State
+    {
+        size_t max_blocks;
+        bool huge_pages;
+        block* heap;
+        block* old_begin;
+        block* old_end;
+        block* heap_end;
+        uint64_t free_bits;
+        block* free_base;
+        size_t free_blocks;
+        size_t live_blocks;
+        block* nursery_top;
+        block** pending;
+        uint64_t* live;
+        block* sweeper;
+        size_t mark_work;
+        uint64_t slice_ns;
+        bool marking;
+        bool step_due;
+        uint64_t* marks;
+        block** mark_stack;
+        size_t mark_top;
+        size_t live_marked;
+        uint64_t cycle_ns;
+    };
+
+    // An empty heap limited to the given number of bytes, which may ask for transparent huge pages
+    // Its memory is only reserved on the first allocation
+    static State create(size_t bytes, bool huge);
+
+    static void destroy(const State& s);
+
+    // Makes s the heap, returns the heap it replaces
+    static State swap(const State& s);
+
+    // Allocates new blocks in a nursery collected apart from the rest of the heap
+    // Must be called before the first allocation
+    static void use_nursery();
+
+    // Marks in slices of at least work blocks spread over the allocations instead of all at once,
+    // with slices kept within ns nanoseconds if it is not 0
+    // Slices grow as the free blocks run low, so that marking ends before they run out
+    // Must be called before use_nursery and the first allocation
+    static void use_incremental(size_t work, uint64_t ns);
+
+    // Has hook called with the length in nanoseconds of every collection of the thread, nullptr for none
+    // A nursery collection counts as one pause with the full collection it may start
+    // The start and every slice of an incremental collection are pauses of their own
+    // The sweep is spread over the allocations, so it is not part of the pauses
+    static void set_pause_hook(void (*hook)(uint64_t ns)) { pause_hook = hook; }
+
+    // c, makes a cell of the two values on top of the stack
+    // They stay on the stack during the allocation, so that the GC sees them
+    static void cell()
+    {
+        safe_point();
+
+#ifdef BEF_COMPACT_HEAP
+        // A cell and two boxes at most, taken before a collection could free the boxes
+        ensure(3);
+#endif
+
+        block* b = alloc();
+        bef_t v2 = Stack::pop();
+        bef_t v1 = Stack::pop();
+        b->head = to_ref(v1);
+        b->tail = to_ref(v2);
+        Stack::push(bef_t{.ptr = b});
+    }
+
+    static bef_t head(bef_t b) { return from_ref(b.ptr->head); }
+
+    static bef_t tail(bef_t b) { return from_ref(b.ptr->tail); }
+
+    // h and t of an integer fail the program, see Fault::Not_a_cell
+    [[noreturn]] static void not_a_cell();
+
+    // b, which h and t may only take once it is checked to be a cell
+    static bef_t check_cell(bef_t b)
+    {
+        if (!is_ptr(b)) not_a_cell();
+        return b;
+    }
+
+    // List operations of --lists
+    // A list is a chain of cells through their tails, up to the first tail that is not a cell,
+    // which is the value the list ends with. A value that is not a cell is an empty list
+    // The ones that allocate work on the stack like cell, so that the GC sees every value in use
 
-        // Get the next free block
-        // If the GC has not run just increment the free_list pointer since initially the whole heap is free
-        if (run_gc_once) free_list = free_list->head.ptr;
-        else free_list++;
-        
-        return prev;
+    // l, number of cells of list
+    static int64_t length(bef_t list);
+
+    // n, head of the cell at index i of list, 0 past its end
+    static bef_t nth(bef_t list, int64_t i);
+
+    // r, replaces the list on top of the stack with a list of its heads in reverse order,
+    // ending with the same value
+    static void reverse();
+
+    // b, pops n and replaces the n values under it with a list of them ending with 0, the deepest first
+    // The same as pushing 0 and making n cells
+    static void build();
+
+    // s, replaces the list on top of the stack with its heads, the first deepest, and their number
+    static void spill();
+
+    // Makes sure the next n cells made by old_cell do not collect garbage, for restoring a snapshot
+    static void reserve_old(size_t n);
+
+    // Makes a cell in the old space without collecting garbage, see reserve_old
+    // Its fields may only point to old cells, such as other cells made this way
+    static bef_t old_cell(bef_t head, bef_t tail)
+    {
+        block* b = alloc_old();
+        b->head = old_ref(head);
+        b->tail = old_ref(tail);
+        return bef_t{.ptr = b};
     }
 
     // Utility function that prints heap's contents
@@ -0,0 +1,124 @@
+#include <algorithm>
+#include <cerrno>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "input.hpp"
+#include "output.hpp"
+#include "stats.hpp"
+
+char Input::storage[Input::BUF_SIZE];
+
+__thread Input::Reader Input::reader = nullptr;
+__thread void* Input::user = nullptr;
+__thread char* Input::buf = storage;
+__thread size_t Input::size = Input::BUF_SIZE;
+__thread const char* Input::cur = nullptr;
+__thread const char* Input::end = nullptr;
+__thread bool Input::started = false;
+__thread bool Input::finished = false;
+
+
+Input::State Input::create(Reader reader, void* user, char* buf, size_t size)
+{
+    return State{reader, user, buf, size, nullptr, nullptr, false, false};
+}
+
+
+Input::State Input::swap(const State& s)
+{
+    State old = {reader, user, buf, size, cur, end, started, finished};
+    reader = s.reader;
+    user = s.user;
+    buf = s.buf;
+    size = s.size;
+    cur = s.cur;
+    end = s.end;
+    started = s.started;
+    finished = s.finished;
+    return old;
+}
+
+
+bool Input::refill()
+{
+    if (finished) return false;
+
+    if (!started && !reader)
+    {
+        started = true;
+
+        struct stat st;
+        if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode))
+        {
+            off_t offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+            if (offset < 0) offset = 0;
+            size_t size = st.st_size > offset ? st.st_size - offset : 0;
+
+            void* data = size > 0 ? mmap(nullptr, size + offset, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0) : MAP_FAILED;
+            if (data != MAP_FAILED)
+            {
+                madvise(data, size + offset, MADV_SEQUENTIAL);
+                cur = (const char*) data + offset;
+                end = cur + size;
+                // The whole file is available, nothing is ever read
+                finished = true;
+                STATS(Stats::input(size, 0));
+                return true;
+            }
+            // Empty files and files that cannot be mapped are read like pipes
+        }
+    }
+
+    // The program may be waiting on a prompt it wrote
+    Output::before_input();
+
+    STATS(uint64_t start = Stats::now());
+    ssize_t n;
+    if (reader) n = reader(user, buf, size);
+    else
+        do n = read(STDIN_FILENO, buf, size);
+        while (n < 0 && errno == EINTR);
+    STATS(Stats::input(n > 0 ? n : 0, Stats::now() - start));
+
+    if (n <= 0)
+    {
+        finished = true;
+        return false;
+    }
+
+    cur = buf;
+    end = buf + n;
+    return true;
+}
+
+
+int64_t Input::read_int()
+{
+    int c = peek();
+    while (c == ' ' || (c >= '\t' && c <= '\r'))
+    {
+        cur++;
+        c = peek();
+    }
+
+    bool negative = c == '-';
+    if (c == '-' || c == '+')
+    {
+        cur++;
+        c = peek();
+    }
+
+    uint64_t i = 0;
+    while (c >= '0' && c <= '9')
+    {
+        // Once i is past INT_LIMIT / 10 any digit saturates it, so i * 10 never overflows
+        i = i > INT_LIMIT / 10 ? INT_LIMIT : std::min<uint64_t>(i * 10 + (c - '0'), INT_LIMIT);
+        cur++;
+        c = peek();
+    }
+
+    return negative ? -(int64_t) i : (int64_t) i;
+}
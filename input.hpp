@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+//Singleton class for the standard input
+//A regular file is mapped in memory, anything else is read through a large buffer
+//Every thread has an input of its own, which reads the standard input until a Vm swaps in another
+class Input
+{
+public:
+    // Reads up to n bytes into data, returns how many, 0 at the end of the input
+    typedef size_t (*Reader)(void* user, char* data, size_t n);
+
+    // The variables of an input, so that several inputs can take turns, see Vm
+    struct State
+    {
+        Reader reader;
+        void* user;
+        char* buf;
+        size_t size;
+        const char* cur;
+        const char* end;
+        bool started;
+        bool finished;
+    };
+
+private:
+    static constexpr size_t BUF_SIZE = 1 << 20;
+
+    // Buffer of the standard input
+    static char storage[BUF_SIZE];
+
+    // Where the input comes from, the standard input if reader is nullptr
+    static __thread Reader reader;
+    static __thread void* user;
+
+    // Buffer the input is read into, unless it is mapped
+    static __thread char* buf;
+    static __thread size_t size;
+
+    // Unread part of the input available without a system call
+    static __thread const char* cur;
+    static __thread const char* end;
+
+    // True once the standard input has been looked at
+    static __thread bool started;
+
+    // True once the input is known to be over
+    static __thread bool finished;
+
+    // Makes more input available, returns false at the end of the input
+    static bool refill();
+
+    static int peek() { return (cur < end || refill()) ? (unsigned char) *cur : -1; }
+
+public:
+    Input() = delete;
+
+    // An input read from reader through the given buffer, or from the standard input if reader is nullptr
+    static State create(Reader reader, void* user, char* buf, size_t size);
+
+    // Makes s the input, returns the input it replaces
+    static State swap(const State& s);
+
+    // Next byte of the input, whitespace included, or -1 at the end of the input
+    static int read_char() { return (cur < end || refill()) ? (unsigned char) *cur++ : -1; }
+
+    // Largest magnitude of the numbers read_int returns, that of the largest 62-bit integer of a cell
+    static constexpr int64_t INT_LIMIT = (INT64_C(1) << 61) - 1;
+
+    // Skips whitespace and reads a decimal integer with an optional sign
+    // Returns 0 and consumes nothing else if there is no number, a sign with no digits after it is consumed
+    // and read as 0. Longer numbers are read whole and saturate to INT_LIMIT or -INT_LIMIT
+    static int64_t read_int();
+};
@@ -0,0 +1,501 @@
+#include <iostream>
+#include <cstdlib>
+#include <utility>
+
+#include "interpreter.hpp"
+#include "bef_type.hpp"
+#include "stack.hpp"
+#include "heap.hpp"
+#include "jit.hpp"
+#include "stats.hpp"
+#include "profile.hpp"
+#include "tracer.hpp"
+#include "random.hpp"
+
+// Enter the trace of state, compiling it if needed
+// The run pauses between traces once max_steps operations ran
+#define ENTER_TRACE                     \
+    if (steps >= max_steps)             \
+        goto pause_label;               \
+    trace = traces.get(state);          \
+    STATS(Stats::enter(*trace));        \
+    if (profile)                        \
+        profile->enter(*trace, state);  \
+    if (tracer)                         \
+        tracer->enter(state,            \
+            Stack::depth() + 1, tos);   \
+    steps += trace->steps;              \
+    op = trace->ops.data();             \
+    if (jit) goto jit_label;            \
+    goto* (op->label);
+
+// instr has to be fetched by the handler beforehand
+#define NEXT_INSTRUCTION ++op; goto* (instr);
+
+
+Interpreter::Interpreter(CodeGrid<char>& rawCode, bool use_jit, bool list_ops) :
+    rawCode(rawCode),
+    traces(rawCode, dispatch_table(), list_ops),
+    jit(use_jit ? new Jit(rawCode) : nullptr),
+    unknown_instr(0),
+    executed(0),
+    profile(nullptr),
+    tracer(nullptr)
+{
+    if (jit) traces.set_jit(jit.get());
+}
+
+
+Interpreter::~Interpreter() {}
+
+
+void* const* Interpreter::dispatch_table()
+{
+    int state = 0;
+    Stop stop;
+    return execute(nullptr, state, 0, stop);
+}
+
+
+void Interpreter::set_profile(Profile* p)
+{
+    profile = p;
+    traces.set_profile(p);
+}
+
+
+void Interpreter::fold_profile()
+{
+    if (profile) traces.fold();
+    Profile::leave();
+}
+
+
+Interpreter::Stop Interpreter::run(int& state, uint64_t max_steps)
+{
+    Stop stop;
+    traces.start(state);
+    execute(this, state, max_steps, stop);
+    return stop;
+}
+
+
+int interpret(CodeGrid<char>& rawCode, int state, bool use_jit, bool list_ops)
+{
+    Interpreter interpreter(rawCode, use_jit, list_ops);
+    if (interpreter.run(state, UINT64_MAX) != Interpreter::Stop::Unknown) return 0;
+
+    Output::flush();
+    std::cerr << "Unknown instruction: " << interpreter.unknown() << std::endl;
+    return 1;
+}
+
+
+void* const* Interpreter::execute(Interpreter* self, int& state, uint64_t max_steps, Stop& stop)
+{
+    // array mapping instructions to labels
+    static void* labels[] =
+    {
+    // GCC does not yet support non-trivial designators unfortunately 
+        /*[Add]        =*/ &&add_label,
+        /*[Sub]        =*/ &&sub_label,
+        /*[Mul]        =*/ &&mul_label,
+        /*[Div]        =*/ &&div_label,
+        /*[Mod]        =*/ &&mod_label,
+        /*[Not]        =*/ &&not_label,
+        /*[Grt]        =*/ &&grt_label,
+        /*[Dup]        =*/ &&dup_label,
+        /*[Swap]       =*/ &&swap_label,
+        /*[Pop]        =*/ &&pop_label,
+        /*[Print_int]  =*/ &&print_int_label,
+        /*[Print_char] =*/ &&print_char_label,
+        /*[Get]        =*/ &&get_label,
+        /*[In_int]     =*/ &&in_int_label,
+        /*[In_char]    =*/ &&in_char_label,
+        /*[Cell]       =*/ &&cell_label,
+        /*[Head]       =*/ &&hd_label,
+        /*[Tail]       =*/ &&tl_label,
+        /*[List_len]   =*/ &&list_len_label,
+        /*[List_nth]   =*/ &&list_nth_label,
+        /*[List_rev]   =*/ &&list_rev_label,
+        /*[List_build] =*/ &&list_build_label,
+        /*[List_spill] =*/ &&list_spill_label,
+        /*[Head_cell]  =*/ &&hd_cell_label,
+        /*[Tail_cell]  =*/ &&tl_cell_label,
+        /*[Push]       =*/ &&push_label,
+        /*[Push_str]   =*/ &&push_str_label,
+        /*[Add_imm]    =*/ &&add_imm_label,
+        /*[Sub_imm]    =*/ &&sub_imm_label,
+        /*[Mul_imm]    =*/ &&mul_imm_label,
+        /*[Div_imm]    =*/ &&div_imm_label,
+        /*[Mod_imm]    =*/ &&mod_imm_label,
+        /*[Grt_imm]    =*/ &&grt_imm_label,
+        /*[Nop]        =*/ &&nop_label,
+        /*[Exec]       =*/ &&exec_label,
+        /*[Exec_num]   =*/ &&exec_num_label,
+        /*[Exec_str]   =*/ &&exec_str_label,
+        /*[Jump]       =*/ &&jump_label,
+        /*[Pc_rand]    =*/ &&pc_rand_label,
+        /*[Horif]      =*/ &&horif_label,
+        /*[Verif]      =*/ &&verif_label,
+        /*[Put]        =*/ &&put_label,
+        /*[End]        =*/ &&end_label,
+        /*[Unk]        =*/ &&unk_label
+    };
+    static_assert(sizeof(labels) / sizeof(labels[0]) == Num_instrs, "a label is missing");
+
+    if (!self) return labels;
+
+    CodeGrid<char>& rawCode = self->rawCode;
+    TraceCache& traces = self->traces;
+    Jit* jit = self->jit.get();
+    Profile* profile = self->profile;
+    Tracer* tracer = self->tracer;
+
+    // Operations of the traces entered during this run
+    uint64_t steps = 0;
+
+    // Directions picked by ?, in the order of Random::dir()
+    static const int rand_dirs[] =
+    {
+        dir_index(Direction::Right),
+        dir_index(Direction::Left),
+        dir_index(Direction::Down),
+        dir_index(Direction::Up)
+    };
+
+    // the trace being executed and its current operation
+    Trace* trace;
+    const TraceOp* op;
+
+    // variable that holds next instruction
+    // it is volatile so as to implement prefetching
+    void* volatile instr;
+    bef_t v1;
+    int64_t x, y;
+    char c;
+
+    // Top of the stack, kept out of memory so that most operations do a single pop or push
+    // It is always valid, since an empty stack holds zeroes: once the last element is popped it is 0,
+    // and pushing on top of it stores a 0 that reads the same as the empty stack below
+    // It is stored on the stack around anything else that uses the stack, such as cell and native code
+    bef_t tos = Stack::pop();
+
+    ENTER_TRACE
+
+//COMMAND         INITIAL STACK (bot->top)RESULT (STACK)
+
+// + (add)         <value1> <value2>       <value1 + value2>
+    add_label:
+        instr = op[1].label;
+        tos = Stack::pop() + tos;
+        NEXT_INSTRUCTION
+    
+// - (subtract)    <value1> <value2>       <value1 - value2>
+    sub_label:
+        instr = op[1].label;
+        tos = Stack::pop() - tos;
+        NEXT_INSTRUCTION
+
+// * (multiply)    <value1> <value2>       <value1 * value2>
+    mul_label:
+        instr = op[1].label;
+        tos = Stack::pop() * tos;
+        NEXT_INSTRUCTION
+
+// / (divide)      <value1> <value2>       <value1 / value2> (nb. integer)
+    div_label:
+        instr = op[1].label;
+        tos = Stack::pop() / tos;
+        NEXT_INSTRUCTION
+        
+// % (modulo)      <value1> <value2>       <value1 mod value2>
+    mod_label:
+        instr = op[1].label;
+        tos = Stack::pop() % tos;
+        NEXT_INSTRUCTION
+        
+// ! (not)         <value>                 <0 if value non-zero, 1 otherwise>
+    not_label:
+        instr = op[1].label;
+        tos = !tos;
+        NEXT_INSTRUCTION
+        
+// ` (greater)     <value1> <value2>       <1 if value1 > value2, 0 otherwise>
+    grt_label:
+        instr = op[1].label;
+        tos = Stack::pop() > tos;
+        NEXT_INSTRUCTION
+
+// : (dup)         <value>                 <value> <value>
+    dup_label:
+        instr = op[1].label;
+        Stack::push(tos);
+        NEXT_INSTRUCTION
+        
+// \ (swap)        <value1> <value2>       <value2> <value1>
+    swap_label:
+        instr = op[1].label;
+        v1 = Stack::pop();
+        Stack::push(tos);
+        tos = v1;
+        NEXT_INSTRUCTION
+    
+// $ (pop)         <value>                 pops <value> but does nothing
+    pop_label:
+        instr = op[1].label;
+        tos = Stack::pop();
+        NEXT_INSTRUCTION
+
+// . (output int)  <value>                 outputs <value> as integer
+    print_int_label:
+        instr = op[1].label;
+        print_int(tos);
+        tos = Stack::pop();
+        NEXT_INSTRUCTION
+
+// , (output char) <value>                 outputs <value> as ASCII
+    print_char_label:
+        instr = op[1].label;
+        print_char(tos);
+        tos = Stack::pop();
+        NEXT_INSTRUCTION
+
+// g (get)         <x> <y>                 <value at (x,y)>
+    get_label:
+        instr = op[1].label;
+        y = bef2int(tos);
+        x = bef2int(Stack::pop());
+        if (profile) profile->get(y, x);
+        // Cells outside the grid read as 0
+        tos = char2bef(CodeGrid<char>::inside(y, x) ? rawCode(y, x) : 0);
+        NEXT_INSTRUCTION
+
+// & (input int)                           <value user entered>
+    in_int_label:
+        instr = op[1].label;
+        Stack::push(tos);
+        tos = read_int();
+        NEXT_INSTRUCTION
+        
+// ~ (input character)                     <character user entered>
+    in_char_label:
+        instr = op[1].label;
+        Stack::push(tos);
+        tos = read_char();
+        NEXT_INSTRUCTION
+
+// c (cons)        <value1> <value2>       <address of allocated cons cell in the heap
+//                                         with head = <value1> and tail = <value2> >
+    cell_label:
+        instr = op[1].label;
+        // The collector finds its roots on the stack
+        Stack::push(tos);
+        Heap::cell();
+        tos = Stack::pop();
+        NEXT_INSTRUCTION
+
+// h (head)        <value>                 <head of cons cell with address <value> >
+    hd_label:
+        instr = op[1].label;
+        tos = Heap::head(Heap::check_cell(tos));
+        NEXT_INSTRUCTION
+
+// t (tail)        <value>                 <tail of cons cell with address <value> >
+    tl_label:
+        instr = op[1].label;
+        tos = Heap::tail(Heap::check_cell(tos));
+        NEXT_INSTRUCTION
+
+// h and t of a value the facts show to be a cell
+    hd_cell_label:
+        instr = op[1].label;
+        tos = Heap::head(tos);
+        NEXT_INSTRUCTION
+
+    tl_cell_label:
+        instr = op[1].label;
+        tos = Heap::tail(tos);
+        NEXT_INSTRUCTION
+
+// l (length)      <list>                  <number of cells of list>
+    list_len_label:
+        instr = op[1].label;
+        tos = int2bef(Heap::length(tos));
+        NEXT_INSTRUCTION
+
+// n (nth)         <list> <index>          <head of the cell at index of list, 0 past its end>
+    list_nth_label:
+        instr = op[1].label;
+        x = bef2int(tos);
+        tos = Heap::nth(Stack::pop(), x);
+        NEXT_INSTRUCTION
+
+// r (reverse)     <list>                  <new list of the heads of list in reverse order>
+    list_rev_label:
+        instr = op[1].label;
+        Stack::push(tos);
+        Heap::reverse();
+        tos = Stack::pop();
+        NEXT_INSTRUCTION
+
+// b (build)       <value1> ... <valueN> <N>   <list of value1 ... valueN ending with 0>
+    list_build_label:
+        instr = op[1].label;
+        Stack::push(tos);
+        Heap::build();
+        tos = Stack::pop();
+        NEXT_INSTRUCTION
+
+// s (spill)       <list>                  <head1> ... <headN> <N>
+    list_spill_label:
+        instr = op[1].label;
+        Stack::push(tos);
+        Heap::spill();
+        tos = Stack::pop();
+        NEXT_INSTRUCTION
+
+// 0...9 and string mode                   push the immediate
+    push_label:
+        instr = op[1].label;
+        Stack::push(tos);
+        tos = op->imm;
+        NEXT_INSTRUCTION
+
+// string mode                           push the span of literals, whose last value becomes tos
+    push_str_label:
+        instr = op[1].label;
+        Stack::push(tos);
+        x = span_first(op->imm);
+        y = span_count(op->imm);
+        Stack::push_all(&trace->literals[x], y - 1);
+        tos = trace->literals[x + y - 1];
+        NEXT_INSTRUCTION
+
+// <number> followed by an operator        <value> <op> <immediate>
+    add_imm_label:
+        instr = op[1].label;
+        tos = tos + op->imm;
+        NEXT_INSTRUCTION
+
+    sub_imm_label:
+        instr = op[1].label;
+        tos = tos - op->imm;
+        NEXT_INSTRUCTION
+
+    mul_imm_label:
+        instr = op[1].label;
+        tos = tos * op->imm;
+        NEXT_INSTRUCTION
+
+    div_imm_label:
+        instr = op[1].label;
+        tos = tos / op->imm;
+        NEXT_INSTRUCTION
+
+    mod_imm_label:
+        instr = op[1].label;
+        tos = tos % op->imm;
+        NEXT_INSTRUCTION
+
+    grt_imm_label:
+        instr = op[1].label;
+        tos = tos > op->imm;
+        NEXT_INSTRUCTION
+
+// <space>                                no operation
+    nop_label:
+        instr = op[1].label;
+        NEXT_INSTRUCTION
+
+// Cells rewritten by p at run time        executed from the code grid
+    exec_label:
+        goto* traces.exec(rawCode(Position::from_index(op->imm.i)));
+
+    exec_num_label:
+        instr = op[1].label;
+        Stack::push(tos);
+        tos = int2bef(rawCode(Position::from_index(op->imm.i)) - '0');
+        NEXT_INSTRUCTION
+
+    exec_str_label:
+        instr = op[1].label;
+        Stack::push(tos);
+        tos = char2bef(rawCode(Position::from_index(op->imm.i)));
+        NEXT_INSTRUCTION
+
+// Native code runs the operations of the trace up to its exit
+    jit_label:
+        Stack::push(tos);
+        if (jit->enter(*trace)) op = &trace->ops.back();
+        tos = Stack::pop();
+        goto* (op->label);
+
+// End of a trace without a branch
+    jump_label:
+        state = trace->next;
+        ENTER_TRACE
+
+// ? (random)                              PC -> right? left? up? down? ???
+    pc_rand_label:
+        x = rand_dirs[Random::dir()];
+        state = trace->exits[x];
+        STATS(Stats::walk(trace->exit_walks[x].cells));
+        if (profile) profile->branch(*trace, x);
+        ENTER_TRACE
+    
+// _ (horizontal if) <boolean value>       PC->left if <value>, else PC->right
+    horif_label:
+        x = dir_index((bool) tos ? Direction::Left : Direction::Right);
+        state = trace->exits[x];
+        STATS(Stats::walk(trace->exit_walks[x].cells));
+        if (profile) profile->branch(*trace, x);
+        tos = Stack::pop();
+        ENTER_TRACE
+        
+// | (vertical if)   <boolean value>       PC->up if <value>, else PC->down
+    verif_label:
+        x = dir_index((bool) tos ? Direction::Up : Direction::Down);
+        state = trace->exits[x];
+        STATS(Stats::walk(trace->exit_walks[x].cells));
+        if (profile) profile->branch(*trace, x);
+        tos = Stack::pop();
+        ENTER_TRACE
+
+// p (put)         <value> <x> <y>         puts <value> at (x,y)
+    put_label:
+        STATS(Stats::put());
+        state = trace->next;
+        y = bef2int(tos);
+        x = bef2int(Stack::pop());
+        c = bef2char(Stack::pop());
+        tos = Stack::pop();
+        if (profile) profile->put(y, x);
+        // Writes outside the grid are ignored
+        if (CodeGrid<char>::inside(y, x) && rawCode(y, x) != c)
+        {
+            if (tracer) tracer->put(y, x, rawCode(y, x), c);
+            std::swap(rawCode(y, x), c);
+            traces.invalidate(y, x, c);
+        }
+        ENTER_TRACE
+
+// Out of steps, the run resumes from state
+    pause_label:
+        Stack::push(tos);
+        self->executed += steps;
+        stop = Stop::Paused;
+        return labels;
+
+// @ (end)                                 ends program
+    end_label:
+        self->executed += steps;
+        stop = Stop::End;
+        return labels;
+
+    unk_label:
+        self->unknown_instr = bef2char(op->imm);
+        self->executed += steps;
+        stop = Stop::Unknown;
+        return labels;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+
+#include "grid.hpp"
+#include "trace.hpp"
+
+class Jit;
+class Profile;
+class Tracer;
+
+// Runs the code of a grid, keeping its traces and native code from one run to the next
+class Interpreter
+{
+public:
+    // Why a run stopped
+    enum class Stop
+    {
+        Paused,    // The steps ran out
+        End,       // @
+        Unknown    // An unknown instruction, see unknown()
+    };
+
+private:
+    CodeGrid<char>& rawCode;
+
+    TraceCache traces;
+
+    std::unique_ptr<Jit> jit;
+
+    // Last unknown instruction met
+    char unknown_instr;
+
+    // Operations of the traces entered by the runs so far
+    uint64_t executed;
+
+    Profile* profile;
+
+    Tracer* tracer;
+
+    // The interpreter loop, which only returns the table of its labels when self is nullptr
+    // It keeps nothing with a destructor, since a fault may jump out of it, see Trap
+    static void* const* execute(Interpreter* self, int& state, uint64_t max_steps, Stop& stop);
+
+    static void* const* dispatch_table();
+
+public:
+    // list_ops makes the list operations of --lists instructions
+    Interpreter(CodeGrid<char>& rawCode, bool use_jit, bool list_ops);
+
+    ~Interpreter();
+
+    // Runs from state, checking at the start of every trace whether max_steps operations have run
+    // state is then where the run stopped, so that it can be resumed from there
+    Stop run(int& state, uint64_t max_steps);
+
+    char unknown() const { return unknown_instr; }
+
+    // Counts the execution of every state and the g and p accesses of every cell in p, nullptr to stop
+    void set_profile(Profile* p);
+
+    // Records the traces entered and the writes of p in t, nullptr to stop
+    void set_tracer(Tracer* t) { tracer = t; }
+
+    // Hands the counts of the traces to the profile, to be called after a run
+    void fold_profile();
+
+    // Counted a trace at a time, so the last trace of a run that failed in the middle counts as a whole,
+    // and a run that faulted does not count
+    uint64_t steps() const { return executed; }
+};
+
+// Runs the code starting from the given (cell, direction) state, see make_state
+// Returns the exit status of the program
+int interpret(CodeGrid<char>& rawCode, int state, bool use_jit, bool list_ops);
@@ -0,0 +1,760 @@
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "jit.hpp"
+#include "heap.hpp"
+#include "profile.hpp"
+
+// Operations that are too big to inline are calls to the following functions
+
+static void jit_print_int(bef_t b) { print_int(b); }
+
+static void jit_print_char(bef_t b) { print_char(b); }
+
+static bef_t jit_get(CodeGrid<char>* grid, bef_t x, bef_t y)
+{
+    int64_t i = bef2int(x), j = bef2int(y);
+    if (Profile* p = Profile::active()) p->get(j, i);
+    return char2bef(CodeGrid<char>::inside(j, i) ? (*grid)(j, i) : 0);
+}
+
+static bef_t jit_in_int() { return read_int(); }
+
+static bef_t jit_in_char() { return read_char(); }
+
+// Works on the stack in memory, so that the GC sees both values
+static void jit_cell() { Heap::cell(); }
+
+static bef_t jit_list_len(bef_t list) { return int2bef(Heap::length(list)); }
+
+static bef_t jit_list_nth(bef_t list, bef_t i) { return Heap::nth(list, bef2int(i)); }
+
+// Works on the stack in memory, like jit_cell
+static void jit_list_rev() { Heap::reverse(); }
+
+static void jit_not_a_cell() { Heap::not_a_cell(); }
+
+#ifdef BEF_COMPACT_HEAP
+static bef_t jit_head(bef_t b) { return Heap::head(Heap::check_cell(b)); }
+
+static bef_t jit_tail(bef_t b) { return Heap::tail(Heap::check_cell(b)); }
+
+static bef_t jit_head_cell(bef_t b) { return Heap::head(b); }
+
+static bef_t jit_tail_cell(bef_t b) { return Heap::tail(b); }
+#endif
+
+
+namespace {
+
+enum Reg : int { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+// Registers values are allocated to. None of them is used to pass arguments
+constexpr Reg pool[] = { RCX, R8, R9, R10, R11, R14, R15 };
+
+// Condition codes for setcc
+constexpr uint8_t CC_E = 0x4, CC_G = 0xF;
+
+// Opcode extensions
+constexpr int EXT_ADD = 0, EXT_SHL = 4, EXT_SAR = 7, EXT_IDIV = 7;
+
+// Encoder for the handful of 64-bit instructions the compiler needs
+struct Assembler
+{
+    std::vector<uint8_t> code;
+
+    void byte(uint8_t b) { code.push_back(b); }
+
+    void imm32(int32_t i) { for (int k = 0; k < 4; k++) byte(i >> (8 * k)); }
+
+    void imm64(int64_t i) { for (int k = 0; k < 8; k++) byte(i >> (8 * k)); }
+
+    void rex(int reg, int rm) { byte(0x48 | ((reg >> 3) << 2) | (rm >> 3)); }
+
+    void modrm(int reg, Reg rm) { byte(0xC0 | ((reg & 7) << 3) | (rm & 7)); }
+
+    // [base + disp32]
+    void modrm(int reg, Reg base, int32_t disp)
+    {
+        byte(0x80 | ((reg & 7) << 3) | (base & 7));
+        if ((base & 7) == RSP) byte(0x24);
+        imm32(disp);
+    }
+
+    static bool fits32(int64_t i) { return i == (int32_t) i; }
+
+    void mov(Reg dst, Reg src) { rex(src, dst); byte(0x89); modrm(src, dst); }
+
+    void mov(Reg dst, int64_t i)
+    {
+        if (fits32(i)) { rex(0, dst); byte(0xC7); modrm(0, dst); imm32(i); }
+        else { rex(0, dst); byte(0xB8 + (dst & 7)); imm64(i); }
+    }
+
+    void load(Reg dst, Reg base, int32_t disp) { rex(dst, base); byte(0x8B); modrm(dst, base, disp); }
+
+    void store(Reg base, int32_t disp, Reg src) { rex(src, base); byte(0x89); modrm(src, base, disp); }
+
+    void add(Reg dst, Reg src) { rex(src, dst); byte(0x01); modrm(src, dst); }
+
+    void sub(Reg dst, Reg src) { rex(src, dst); byte(0x29); modrm(src, dst); }
+
+    void cmp(Reg lhs, Reg rhs) { rex(rhs, lhs); byte(0x39); modrm(rhs, lhs); }
+
+    void test(Reg lhs, Reg rhs) { rex(rhs, lhs); byte(0x85); modrm(rhs, lhs); }
+
+    void add(Reg dst, int32_t i) { rex(0, dst); byte(0x81); modrm(EXT_ADD, dst); imm32(i); }
+
+    void imul(Reg dst, Reg src) { rex(dst, src); byte(0x0F); byte(0xAF); modrm(dst, src); }
+
+    void imul(Reg dst, Reg src, int32_t i) { rex(dst, src); byte(0x69); modrm(dst, src); imm32(i); }
+
+    void shift(int ext, Reg dst, uint8_t n) { rex(0, dst); byte(0xC1); modrm(ext, dst); byte(n); }
+
+    void cqo() { byte(0x48); byte(0x99); }
+
+    void idiv(Reg src) { rex(0, src); byte(0xF7); modrm(EXT_IDIV, src); }
+
+    // rax = 1 if the condition holds, else 0
+    void setcc(uint8_t cc)
+    {
+        byte(0x0F); byte(0x90 | cc); byte(0xC0);
+        byte(0x48); byte(0x0F); byte(0xB6); byte(0xC0);
+    }
+
+    // Retag the 0/1 in rax as a bef_t into dst
+    void retag_bool(Reg dst)
+    {
+        shift(EXT_SHL, RAX, 2);
+        add(RAX, 1);
+        mov(dst, RAX);
+    }
+
+    void call(const void* fn) { mov(RAX, (int64_t) fn); byte(0xFF); byte(0xD0); }
+
+    void push(Reg r) { if (r >= R8) byte(0x41); byte(0x50 + (r & 7)); }
+
+    void pop(Reg r) { if (r >= R8) byte(0x41); byte(0x58 + (r & 7)); }
+
+    void ret() { byte(0xC3); }
+
+    void append(const Assembler& other) { code.insert(code.end(), other.code.begin(), other.code.end()); }
+};
+
+
+// A value of the stack kept by the compiler
+struct Value
+{
+    bool is_const;
+    bef_t c;
+    Reg r;
+};
+
+// Compiles the body of a trace keeping the top of the stack in registers
+// While compiling, rbx holds the stack pointer, r12 its address and r13 the bottom of the stack
+class TraceCompiler
+{
+private:
+    Assembler as;
+
+    // Values pushed by the trace that are not yet written to memory
+    std::vector<Value> vstack;
+
+    bool reg_free[16];
+
+    // Position of rbx relative to the stack pointer at the entry of the trace, in elements
+    int top = 0;
+
+    // Elements under rbx that have been popped into vstack or dropped
+    int consumed = 0;
+
+    // Minimum stack depth at the entry of the trace
+    int need = 0;
+
+    CodeGrid<char>& grid;
+
+    // Literals of the trace being compiled, for Push_str
+    const std::vector<bef_t>* literals = nullptr;
+
+    Reg alloc()
+    {
+        for (int k = 0; k < 2; k++)
+        {
+            for (Reg r : pool)
+                if (reg_free[r])
+                {
+                    reg_free[r] = false;
+                    return r;
+                }
+            flush();
+        }
+        // Unreachable, an operation keeps at most three values outside vstack
+        return RAX;
+    }
+
+    void release(Value v) { if (!v.is_const) reg_free[v.r] = true; }
+
+    // Element of memory at rbx - consumed is needed, which is at top - consumed relative to the entry
+    void consume()
+    {
+        need = std::max(need, 1 - (top - consumed));
+        consumed++;
+    }
+
+    Value pop()
+    {
+        if (!vstack.empty())
+        {
+            Value v = vstack.back();
+            vstack.pop_back();
+            return v;
+        }
+
+        Reg r = alloc();
+        as.load(r, RBX, -8 * consumed);
+        consume();
+        return Value{false, {}, r};
+    }
+
+    void drop()
+    {
+        if (!vstack.empty()) { release(vstack.back()); vstack.pop_back(); }
+        else consume();
+    }
+
+    void push(Value v) { vstack.push_back(v); }
+
+    void push(Reg r) { vstack.push_back(Value{false, {}, r}); }
+
+    void push(bef_t c) { vstack.push_back(Value{true, c, RAX}); }
+
+    // Register holding v, loading constants
+    Reg reg(Value v)
+    {
+        if (!v.is_const) return v.r;
+
+        Reg r = alloc();
+        as.mov(r, v.c.i);
+        return r;
+    }
+
+    // Write vstack to memory and make rbx point to the top of the stack
+    void flush()
+    {
+        int n = vstack.size();
+
+        for (int k = 0; k < n; k++)
+        {
+            int32_t disp = 8 * (k + 1 - consumed);
+            if (vstack[k].is_const)
+            {
+                as.mov(RAX, vstack[k].c.i);
+                as.store(RBX, disp, RAX);
+            }
+            else
+            {
+                as.store(RBX, disp, vstack[k].r);
+                release(vstack[k]);
+            }
+        }
+
+        if (n != consumed) as.add(RBX, 8 * (n - consumed));
+
+        top += n - consumed;
+        consumed = 0;
+        vstack.clear();
+    }
+
+    // Flush and make sure the stack holds at least depth elements for a call
+    void flush(int depth)
+    {
+        flush();
+        need = std::max(need, depth - top);
+    }
+
+    void binary(Instr instr);
+
+    void unary(Instr instr, bef_t imm);
+
+    bool op(const TraceOp& op);
+
+public:
+    TraceCompiler(CodeGrid<char>& grid) : grid(grid)
+    {
+        for (bool& f : reg_free) f = false;
+        for (Reg r : pool) reg_free[r] = true;
+    }
+
+    bool compile(const Trace& t, Assembler& out);
+};
+
+
+void TraceCompiler::binary(Instr instr)
+{
+    Value b = pop();
+    Value a = pop();
+
+    bool divides = instr == Div || instr == Mod;
+
+    if (a.is_const && b.is_const && !(divides && bef2int(b.c) == 0))
+    {
+        switch (instr)
+        {
+            case Add: push(a.c + b.c); break;
+            case Sub: push(a.c - b.c); break;
+            case Mul: push(a.c * b.c); break;
+            case Div: push(a.c / b.c); break;
+            case Mod: push(a.c % b.c); break;
+            default:  push(a.c > b.c); break;
+        }
+        return;
+    }
+
+    Reg ra = reg(a);
+
+    // Operations with a small constant rhs use it as an immediate
+    bool imm = b.is_const && !divides && Assembler::fits32(b.c.i - 1) && Assembler::fits32(1 - b.c.i);
+    // Larger ones are loaded in a register
+    if (b.is_const && !imm) b = Value{false, {}, reg(b)};
+
+    switch (instr)
+    {
+        case Add:
+            if (imm) as.add(ra, b.c.i - 1);
+            else { as.add(ra, b.r); as.add(ra, -1); }
+            break;
+        case Sub:
+            if (imm) as.add(ra, 1 - b.c.i);
+            else { as.sub(ra, b.r); as.add(ra, 1); }
+            break;
+        case Mul:
+            as.shift(EXT_SAR, ra, 2);
+            if (imm) as.imul(ra, ra, b.c.i - 1);
+            else { as.add(b.r, -1); as.imul(ra, b.r); }
+            as.add(ra, 1);
+            break;
+        case Div:
+        case Mod:
+        {
+            Reg rb = reg(b);
+            b = Value{false, {}, rb};
+            as.mov(RAX, ra);
+            as.shift(EXT_SAR, RAX, 2);
+            as.cqo();
+            as.shift(EXT_SAR, rb, 2);
+            as.idiv(rb);
+            Reg res = (instr == Div) ? RAX : RDX;
+            as.shift(EXT_SHL, res, 2);
+            as.add(res, 1);
+            as.mov(ra, res);
+            break;
+        }
+        default:
+            if (imm) { as.mov(RAX, b.c.i); as.cmp(ra, RAX); }
+            else as.cmp(ra, b.r);
+            as.setcc(CC_G);
+            as.retag_bool(ra);
+            break;
+    }
+
+    release(b);
+    push(ra);
+}
+
+
+void TraceCompiler::unary(Instr instr, bef_t imm)
+{
+    Value a = pop();
+
+    if (instr == Not && a.is_const)
+    {
+        push(!a.c);
+        return;
+    }
+
+    Reg ra = reg(a);
+
+    switch (instr)
+    {
+        case Add_imm: as.mov(RAX, imm.i - 1); as.add(ra, RAX); break;
+        case Sub_imm: as.mov(RAX, 1 - imm.i); as.add(ra, RAX); break;
+        case Mul_imm:
+            as.shift(EXT_SAR, ra, 2);
+            as.mov(RAX, imm.i - 1);
+            as.imul(ra, RAX);
+            as.add(ra, 1);
+            break;
+        case Grt_imm:
+            as.mov(RAX, imm.i);
+            as.cmp(ra, RAX);
+            as.setcc(CC_G);
+            as.retag_bool(ra);
+            break;
+        case Not:
+            as.shift(EXT_SAR, ra, 2);
+            as.test(ra, ra);
+            as.setcc(CC_E);
+            as.retag_bool(ra);
+            break;
+        // The tag is tested where the facts do not show a cell, an integer jumps out through the trap
+        case Head:
+        case Tail:
+        {
+            Assembler fail;
+            fail.call((const void*) jit_not_a_cell);
+            as.mov(RAX, 1);
+            as.test(ra, RAX);
+            // jz rel8
+            as.byte(0x74); as.byte(fail.code.size());
+            as.append(fail);
+            as.load(ra, ra, instr == Head ? offsetof(block, head) : offsetof(block, tail));
+            break;
+        }
+        case Head_cell: as.load(ra, ra, offsetof(block, head)); break;
+        default:        as.load(ra, ra, offsetof(block, tail)); break;
+    }
+
+    push(ra);
+}
+
+
+bool TraceCompiler::op(const TraceOp& op)
+{
+    switch (op.instr)
+    {
+        case Add:
+        case Sub:
+        case Mul:
+        case Div:
+        case Mod:
+        case Grt:
+            binary(op.instr);
+            break;
+        case Div_imm:
+        case Mod_imm:
+            push(op.imm);
+            binary(op.instr == Div_imm ? Div : Mod);
+            break;
+        case Add_imm:
+        case Sub_imm:
+        case Mul_imm:
+        case Grt_imm:
+        case Not:
+#ifndef BEF_COMPACT_HEAP
+        case Head:
+        case Tail:
+        case Head_cell:
+        case Tail_cell:
+#endif
+            unary(op.instr, op.imm);
+            break;
+#ifdef BEF_COMPACT_HEAP
+        // References in cells are expanded by a helper
+        case Head:
+        case Tail:
+        case Head_cell:
+        case Tail_cell:
+        {
+            bef_t (*helper)(bef_t) = op.instr == Head ? jit_head : op.instr == Tail ? jit_tail
+                : op.instr == Head_cell ? jit_head_cell : jit_tail_cell;
+            Value a = pop();
+            Reg ra = reg(a);
+            flush();
+            as.mov(RDI, ra);
+            release(Value{false, {}, ra});
+            as.call((const void*) helper);
+            Reg r = alloc();
+            as.mov(r, RAX);
+            push(r);
+            break;
+        }
+#endif
+        case Push:
+            push(op.imm);
+            break;
+        case Push_str:
+            for (uint32_t k = 0; k < span_count(op.imm); k++) push((*literals)[span_first(op.imm) + k]);
+            break;
+        case Dup:
+        {
+            Value a = pop();
+            if (a.is_const)
+            {
+                push(a);
+                push(a);
+            }
+            else
+            {
+                Reg r = alloc();
+                as.mov(r, a.r);
+                push(a);
+                push(r);
+            }
+            break;
+        }
+        case Swap:
+        {
+            Value b = pop();
+            Value a = pop();
+            push(b);
+            push(a);
+            break;
+        }
+        case Pop:
+            drop();
+            break;
+        case Nop:
+            break;
+        case Exec_str:
+        {
+            Reg r = alloc();
+            as.mov(r, (int64_t) &grid(Position::from_index(op.imm.i)));
+            // movsx r, byte [r]
+            as.rex(r, r); as.byte(0x0F); as.byte(0xBE); as.modrm(r, r, 0);
+            as.shift(EXT_SHL, r, 2);
+            as.add(r, 1);
+            push(r);
+            break;
+        }
+        case Print_int:
+        case Print_char:
+        {
+            Value a = pop();
+            Reg ra = reg(a);
+            flush();
+            as.mov(RDI, ra);
+            release(Value{false, {}, ra});
+            as.call((const void*) (op.instr == Print_int ? jit_print_int : jit_print_char));
+            break;
+        }
+        case Get:
+        {
+            Value y = pop();
+            Value x = pop();
+            Reg ry = reg(y), rx = reg(x);
+            flush();
+            as.mov(RDI, (int64_t) &grid);
+            as.mov(RSI, rx);
+            as.mov(RDX, ry);
+            release(Value{false, {}, rx});
+            release(Value{false, {}, ry});
+            as.call((const void*) jit_get);
+            Reg r = alloc();
+            as.mov(r, RAX);
+            push(r);
+            break;
+        }
+        case In_int:
+        case In_char:
+        {
+            flush();
+            as.call((const void*) (op.instr == In_int ? jit_in_int : jit_in_char));
+            Reg r = alloc();
+            as.mov(r, RAX);
+            push(r);
+            break;
+        }
+        case Cell:
+            flush(2);
+            as.store(R12, 0, RBX);
+            as.call((const void*) jit_cell);
+            as.load(RBX, R12, 0);
+            top--;
+            break;
+        case List_len:
+        {
+            Value a = pop();
+            Reg ra = reg(a);
+            flush();
+            as.mov(RDI, ra);
+            release(Value{false, {}, ra});
+            as.call((const void*) jit_list_len);
+            Reg r = alloc();
+            as.mov(r, RAX);
+            push(r);
+            break;
+        }
+        case List_nth:
+        {
+            Value i = pop();
+            Value list = pop();
+            Reg ri = reg(i), rl = reg(list);
+            flush();
+            as.mov(RDI, rl);
+            as.mov(RSI, ri);
+            release(Value{false, {}, rl});
+            release(Value{false, {}, ri});
+            as.call((const void*) jit_list_nth);
+            Reg r = alloc();
+            as.mov(r, RAX);
+            push(r);
+            break;
+        }
+        case List_rev:
+            flush(1);
+            as.store(R12, 0, RBX);
+            as.call((const void*) jit_list_rev);
+            as.load(RBX, R12, 0);
+            break;
+        // Exec may turn into any simple instruction, and b and s change the depth of the stack by a count
+        // known only at run time
+        default:
+            return false;
+    }
+
+    return true;
+}
+
+
+bool TraceCompiler::compile(const Trace& t, Assembler& out)
+{
+    literals = &t.literals;
+    for (size_t k = 0; k + 1 < t.ops.size(); k++)
+        if (!op(t.ops[k])) return false;
+
+    flush();
+    as.store(R12, 0, RBX);
+
+    static constexpr Reg saved[] = { RBX, R12, R13, R14, R15 };
+
+    for (Reg r : saved) out.push(r);
+    out.mov(R12, RDI);
+    out.mov(R13, RSI);
+    out.load(RBX, R12, 0);
+
+    // Bail out if the stack is not deep enough: rbx - r13 < 8 * (need - 1)
+    // The interpreter stores the top before entering, so the stack holds at least one element, and as many
+    // as the facts at the entry show
+    if (need <= std::max(t.depth, 1)) need = 0;
+    std::vector<uint8_t>::size_type jump = 0;
+    if (need > 0)
+    {
+        out.mov(RAX, RBX);
+        out.sub(RAX, R13);
+        out.mov(RDX, 8 * (need - 1));
+        out.cmp(RAX, RDX);
+        // jl rel32
+        out.byte(0x0F); out.byte(0x8C);
+        jump = out.code.size();
+        out.imm32(0);
+    }
+
+    out.append(as);
+    out.mov(RAX, 1);
+    for (int k = 4; k >= 0; k--) out.pop(saved[k]);
+    out.ret();
+
+    if (need > 0)
+    {
+        int32_t rel = out.code.size() - (jump + 4);
+        std::memcpy(&out.code[jump], &rel, 4);
+        out.mov(RAX, 0);
+        for (int k = 4; k >= 0; k--) out.pop(saved[k]);
+        out.ret();
+    }
+
+    return true;
+}
+
+}
+
+
+Jit::Jit(CodeGrid<char>& grid) : used(0), grid(grid)
+{
+    void* mem = mmap(nullptr, CODE_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    code = (mem == MAP_FAILED) ? nullptr : (uint8_t*) mem;
+}
+
+Jit::~Jit()
+{
+    if (code) munmap(code, CODE_SIZE);
+}
+
+
+bool Jit::compile(Trace& t)
+{
+    // Traces that are just an exit are not worth it
+    if (!code || t.ops.size() < 2) return false;
+
+    Assembler out;
+    if (!TraceCompiler(grid).compile(t, out)) return false;
+
+    // Once the memory is full of the code of live traces, the rest of the traces are interpreted
+    size_t n = (out.code.size() + 15) & ~15;
+    size_t offset = allocate(n);
+    if (offset == CODE_SIZE) return false;
+
+    static const size_t page = sysconf(_SC_PAGESIZE);
+    uint8_t* first = code + offset / page * page;
+    size_t length = (offset + n + page - 1) / page * page - (first - code);
+    if (mprotect(first, length, PROT_READ | PROT_WRITE) != 0)
+    {
+        free(offset, n);
+        return false;
+    }
+
+    std::memcpy(code + offset, out.code.data(), out.code.size());
+    mprotect(first, length, PROT_READ | PROT_EXEC);
+    t.native = (NativeTrace) (code + offset);
+    t.native_size = n;
+
+    return true;
+}
+
+
+size_t Jit::allocate(size_t n)
+{
+    // The first freed part big enough, whose rest stays free
+    for (auto p = free_parts.begin(); p != free_parts.end(); ++p)
+        if (p->second >= n)
+        {
+            size_t offset = p->first, left = p->second - n;
+            free_parts.erase(p);
+            if (left) free_parts[offset + n] = left;
+            return offset;
+        }
+
+    if (used + n > CODE_SIZE) return CODE_SIZE;
+    used += n;
+    return used - n;
+}
+
+
+void Jit::release(Trace& t)
+{
+    if (!t.native) return;
+
+    free((uint8_t*) t.native - code, t.native_size);
+    t.native = nullptr;
+}
+
+
+void Jit::free(size_t offset, size_t n)
+{
+    // Merged with the free parts on either side
+    auto next = free_parts.lower_bound(offset);
+    if (next != free_parts.end() && next->first == offset + n)
+    {
+        n += next->second;
+        next = free_parts.erase(next);
+    }
+    if (next != free_parts.begin())
+    {
+        auto prev = std::prev(next);
+        if (prev->first + prev->second == offset)
+        {
+            offset = prev->first;
+            n += prev->second;
+            free_parts.erase(prev);
+        }
+    }
+
+    // A part reaching used is given back to the part never used
+    if (offset + n == used) used = offset;
+    else free_parts[offset] = n;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+
+#include "bef_type.hpp"
+#include "grid.hpp"
+#include "stack.hpp"
+#include "trace.hpp"
+
+// Compiles the operations of hot traces, up to their exit, to x86-64 code
+// The exit itself is always left to the interpreter
+// The pages of native code are only made writable while a trace is written to them, and executable otherwise
+class Jit
+{
+private:
+    // Size of the memory reserved for native code
+    static constexpr size_t CODE_SIZE = 16 << 20;
+
+    // Number of entries after which a trace is compiled
+    static constexpr unsigned HOT = 64;
+
+    uint8_t* code;
+
+    // Start of the part of code never used
+    size_t used;
+
+    // Parts of code before used freed by the traces dropped, size by offset, with no two parts next to each other
+    std::map<size_t, size_t> free_parts;
+
+    CodeGrid<char>& grid;
+
+    bool compile(Trace& t);
+
+    // Offset of n free bytes of code, CODE_SIZE if there are none
+    size_t allocate(size_t n);
+
+    // Gives the n bytes of code at offset back
+    void free(size_t offset, size_t n);
+
+public:
+    Jit(CodeGrid<char>& grid);
+
+    ~Jit();
+
+    // Frees the native code of t, for a trace that is dropped
+    void release(Trace& t);
+
+    // Runs the native code of t, compiling it once t gets hot
+    // Returns false if the operations of t still have to be interpreted
+    bool enter(Trace& t)
+    {
+        if (!t.native && (++t.entries != HOT || !compile(t))) return false;
+
+        return t.native(&Stack::sp, Stack::stack);
+    }
+};
@@ -0,0 +1,73 @@
+#include "nav.hpp"
+
+Navigator::Navigator(CodeGrid<char>& code)
+    : code(code), neighbor(numStates), successor(numStates), pinned(gridH * gridW)
+{
+    for (int state = 0; state < numStates; state++)
+    {
+        Position pos = state_pos(state);
+        pos.step(state_dir(state));
+        neighbor[state] = make_state(pos, state_dir(state));
+    }
+
+    for (int state = 0; state < numStates; state++) successor[state] = walk(state);
+}
+
+
+int Navigator::walk(int state)
+{
+    int s = neighbor[state];
+    if (code(state_pos(state)) == '#') s = neighbor[s];
+
+    // A line of spaces and bridges is walked forever, that is left to the trace compiler
+    // which sees the states repeat
+    for (int n = 0; n < 2 * gridW + 2; n++)
+    {
+        if (skipped(s / 4)) s = neighbor[s];
+        else if (bridge(s / 4)) s = neighbor[neighbor[s]];
+        else return s;
+    }
+    return neighbor[state];
+}
+
+
+void Navigator::refresh(int cell)
+{
+    Position pos = Position::from_index(cell);
+
+    for (int x = 0; x < gridW; x++)
+        for (Direction dir : { Direction::Right, Direction::Left })
+        {
+            int state = make_state(Position(pos.y(), x), dir);
+            successor[state] = walk(state);
+        }
+
+    for (int y = 0; y < gridH; y++)
+        for (Direction dir : { Direction::Down, Direction::Up })
+        {
+            int state = make_state(Position(y, pos.x()), dir);
+            successor[state] = walk(state);
+        }
+}
+
+
+void Navigator::pin(int cell)
+{
+    if (pinned[cell]) return;
+
+    pinned[cell] = true;
+    refresh(cell);
+}
+
+
+void Navigator::update(int y, int x, char old)
+{
+    int cell = Position(y, x).index();
+    char c = code(y, x);
+
+    // Only spaces and bridges change the way through the grid
+    // and only bridges for pinned cells, which are still executed
+    auto way = [] (char ch) { return ch == ' ' ? 1 : ch == '#' ? 2 : 0; };
+    bool changed = pinned[cell] ? (old == '#') != (c == '#') : way(old) != way(c);
+    if (changed) refresh(cell);
+}
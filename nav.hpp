@@ -0,0 +1,44 @@
+#pragma once
+
+#include <vector>
+
+#include "grid.hpp"
+
+// Successor of every (cell, direction) state, with wrapping, spaces and bridges already resolved
+// so that moving to the next instruction is a single load
+class Navigator
+{
+private:
+    CodeGrid<char>& code;
+
+    // State of the neighbouring cell in the same direction
+    std::vector<int> neighbor;
+
+    // State of the next instruction executed after the cell of the state
+    std::vector<int> successor;
+
+    // Cells that are never skipped, whatever they hold
+    std::vector<bool> pinned;
+
+    bool skipped(int cell) { return !pinned[cell] && code(Position::from_index(cell)) == ' '; }
+
+    bool bridge(int cell) { return !pinned[cell] && code(Position::from_index(cell)) == '#'; }
+
+    int walk(int state);
+
+    // Recomputes the successors of the states of the row and column of cell
+    void refresh(int cell);
+
+public:
+    Navigator(CodeGrid<char>& code);
+
+    int step(int state) const { return neighbor[state]; }
+
+    int next(int state) const { return successor[state]; }
+
+    // Stops skipping cell, for cells whose content keeps changing
+    void pin(int cell);
+
+    // Must be called after cell (y, x) changes from old
+    void update(int y, int x, char old);
+};
@@ -0,0 +1,293 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <ctime>
+#include <thread>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "output.hpp"
+#include "stats.hpp"
+
+__thread char Output::buf[BUF_SIZE];
+__thread size_t Output::used = 0;
+size_t Output::limit = BUF_SIZE - SLACK;
+bool Output::watch = false;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+Output::Policy policy = Output::Policy::Input;
+
+std::chrono::milliseconds max_age(0);
+
+__thread Output::Sink sink = {nullptr, nullptr};
+
+// Time of the first write since the last flush, for the Time policy of output written to a sink
+__thread Clock::time_point oldest;
+__thread bool aging = false;
+
+// True while the buffer is being written, when a signal handler cannot tell what of it is left
+__thread volatile sig_atomic_t flushing = 0;
+
+// Only makes system calls, so that it can be called from a signal handler
+void write_all(const char* data, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t w = write(STDOUT_FILENO, data, n);
+        if (w < 0 && errno == EINTR) continue;
+        // Nothing sensible can be done with output nobody reads
+        if (w <= 0) return;
+        data += w;
+        n -= w;
+    }
+}
+
+
+// Single producer single consumer ring buffer between the interpreter and the writer thread
+// head and tail only grow, their difference is the number of pending bytes
+constexpr size_t RING_SIZE = 1 << 22;
+
+char ring[RING_SIZE];
+
+std::atomic<size_t> head(0), tail(0);
+
+std::atomic<bool> done(false);
+
+// Position of the ring up to which the Time policy cannot hold the output back, such as a prompt
+std::atomic<size_t> due(0);
+
+std::thread writer;
+
+// True once the writer thread is started, read by signal handlers instead of writer
+std::atomic<bool> writing(false);
+
+void enqueue(const char* data, size_t n)
+{
+    size_t t = tail.load(std::memory_order_relaxed);
+    while (n > 0)
+    {
+        size_t room = RING_SIZE - (t - head.load(std::memory_order_acquire));
+        if (room == 0)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+
+        size_t offset = t % RING_SIZE;
+        size_t k = std::min(std::min(n, room), RING_SIZE - offset);
+        std::memcpy(ring + offset, data, k);
+        data += k;
+        n -= k;
+        t += k;
+        tail.store(t, std::memory_order_release);
+    }
+}
+
+void drain()
+{
+    size_t h = head.load(std::memory_order_relaxed);
+
+    // When the writer first saw the output it holds back for the Time policy
+    Clock::time_point seen;
+    bool holding = false;
+
+    while (true)
+    {
+        // done is read first, so that everything published before it is seen
+        bool finished = done.load(std::memory_order_acquire);
+        size_t t = tail.load(std::memory_order_acquire);
+        if (h == t)
+        {
+            if (finished) return;
+            holding = false;
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+            continue;
+        }
+
+        // The age is counted from when the output is seen, which is at most a sleep after it is written
+        if (policy == Output::Policy::Time && !finished && h >= due.load(std::memory_order_acquire)
+            && t - h < RING_SIZE / 2)
+        {
+            Clock::time_point now = Clock::now();
+            if (!holding) seen = now, holding = true;
+            if (now - seen < max_age)
+            {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+                continue;
+            }
+        }
+        holding = false;
+
+        size_t offset = h % RING_SIZE;
+        size_t k = std::min(t - h, RING_SIZE - offset);
+        write_all(ring + offset, k);
+        h += k;
+        head.store(h, std::memory_order_release);
+    }
+}
+
+// Flushes whatever is left when the program exits, also through exit()
+struct Closer
+{
+    ~Closer() { Output::close(); }
+} closer;
+
+
+// Ends the process as the signal would, once the output is written
+void on_signal(int sig)
+{
+    Output::flush_from_signal();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+}
+
+
+void Output::install_signal_handlers()
+{
+    for (int sig : {SIGINT, SIGTERM})
+    {
+        struct sigaction old;
+        if (sigaction(sig, nullptr, &old) != 0 || (old.sa_flags & SA_SIGINFO) || old.sa_handler != SIG_DFL) continue;
+
+        struct sigaction sa = {};
+        sa.sa_handler = on_signal;
+        sigemptyset(&sa.sa_mask);
+        sigaction(sig, &sa, nullptr);
+    }
+}
+
+
+void Output::configure(Policy p, size_t threshold)
+{
+    policy = p;
+    limit = BUF_SIZE - SLACK;
+    watch = false;
+
+    switch (p)
+    {
+        case Policy::Line:
+            watch = true;
+            break;
+        case Policy::Time:
+            watch = true;
+            max_age = std::chrono::milliseconds(threshold);
+            start_writer();
+            break;
+        case Policy::Size:
+            if (threshold > 0 && threshold < limit) limit = threshold;
+            break;
+        default:
+            break;
+    }
+}
+
+
+void Output::start_writer()
+{
+    if (writer.joinable()) return;
+
+    // The signals that end the process are left to the thread writing the output, see flush_from_signal
+    sigset_t blocked, old;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &blocked, &old);
+    writer = std::thread(drain);
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+    writing.store(true);
+}
+
+
+Output::Sink Output::redirect(const Sink& s)
+{
+    flush();
+
+    Sink old = sink;
+    sink = s;
+    return old;
+}
+
+
+void Output::written(char c)
+{
+    if (used >= limit) flush();
+    else if (policy == Policy::Line && c == '\n') flush();
+    else if (policy == Policy::Time && !sink.writer) flush();
+    else if (policy == Policy::Time)
+    {
+        Clock::time_point now = Clock::now();
+        if (!aging) oldest = now, aging = true;
+        else if (now - oldest >= max_age) flush();
+    }
+}
+
+
+void Output::before_input()
+{
+    if (policy == Policy::Exit) return;
+
+    flush();
+    due.store(tail.load(std::memory_order_relaxed), std::memory_order_release);
+}
+
+
+void Output::flush()
+{
+    if (used == 0) return;
+
+    STATS(uint64_t start = Stats::now());
+    flushing = 1;
+    if (sink.writer) sink.writer(sink.user, buf, used);
+    else if (writer.joinable()) enqueue(buf, used);
+    else write_all(buf, used);
+    STATS(Stats::output(used, Stats::now() - start));
+    used = 0;
+    flushing = 0;
+    aging = false;
+}
+
+
+void Output::flush_from_signal()
+{
+    int saved = errno;
+
+    // The writer thread writes what it holds at once when done, and is given a second to
+    if (writing.load())
+    {
+        done.store(true, std::memory_order_release);
+        timespec start, now;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        while (head.load(std::memory_order_acquire) != tail.load(std::memory_order_acquire)
+            && clock_gettime(CLOCK_MONOTONIC, &now) == 0
+            && (now.tv_sec - start.tv_sec) * 1000000000L + now.tv_nsec - start.tv_nsec < 1000000000L);
+    }
+
+    // A write interrupted in the middle leaves the buffer as it is
+    if (!flushing && !sink.writer)
+    {
+        write_all(buf, used);
+        used = 0;
+    }
+    errno = saved;
+}
+
+
+void Output::close()
+{
+    flush();
+
+    if (writer.joinable())
+    {
+        done.store(true, std::memory_order_release);
+        writer.join();
+    }
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+//Singleton class for the standard output
+//Values are gathered in a buffer that is written when the flush policy asks for it,
+//either directly or by a writer thread fed through a lock-free ring buffer
+//Every thread has a buffer and a sink of its own, the policy is the same for all of them
+class Output
+{
+public:
+    enum class Policy
+    {
+        Exit,    // Only when the buffer is full and at exit
+        Line,    // After every newline
+        Input,   // Before reading input
+        Size,    // Once the buffer holds the threshold in bytes
+        Time     // Once the oldest buffered byte is older than the threshold in milliseconds, kept by the writer thread
+    };
+
+    // Writes the n bytes of data somewhere else than the standard output
+    typedef void (*Writer)(void* user, const char* data, size_t n);
+
+    // Where the output goes, the standard output if writer is nullptr
+    struct Sink
+    {
+        Writer writer;
+        void* user;
+    };
+
+private:
+    static constexpr size_t BUF_SIZE = 1 << 16;
+
+    // Room kept at the end of buf for one formatted integer
+    static constexpr size_t SLACK = 32;
+
+    static __thread char buf[BUF_SIZE];
+
+    // Number of bytes in buf
+    static __thread size_t used;
+
+    // used at which buf is flushed
+    static size_t limit;
+
+    // True if every write has to be checked against the policy
+    static bool watch;
+
+    // Slow path of the writes, c is the last character written
+    static void written(char c);
+
+public:
+    Output() = delete;
+
+    // threshold is only used by the Size and Time policies
+    // The Time policy starts the writer thread, which holds the output back until it is old enough,
+    // so that a program computing after it printed still gets its output written
+    static void configure(Policy policy, size_t threshold);
+
+    // Hands the writes to the standard output over to a background thread
+    static void start_writer();
+
+    // Flushes the output to the current sink, and makes s the sink, returns the sink it replaces
+    static Sink redirect(const Sink& s);
+
+    static void put_char(char c)
+    {
+        buf[used++] = c;
+        if (used >= limit || watch) written(c);
+    }
+
+    static void put_int(int64_t i)
+    {
+        char digits[24];
+        char* d = digits + sizeof(digits);
+        uint64_t u = i < 0 ? -(uint64_t) i : i;
+        do *--d = '0' + u % 10; while (u /= 10);
+        if (i < 0) *--d = '-';
+
+        while (d < digits + sizeof(digits)) buf[used++] = *d++;
+        if (used >= limit || watch) written('0');
+    }
+
+    // Called before reading the standard input, so that prompts are shown
+    static void before_input();
+
+    static void flush();
+
+    // Writes the buffer of the thread and what the writer thread holds with system calls only,
+    // for signal handlers about to end the process. Output of the thread redirected elsewhere is left
+    static void flush_from_signal();
+
+    // Makes SIGINT and SIGTERM write the buffered standard output before they end the process,
+    // unless they are ignored or already handled
+    static void install_signal_handlers();
+
+    // Flushes and waits for the writer thread, done automatically at exit
+    static void close();
+};
@@ -0,0 +1,196 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <ctime>
+
+#include <sys/time.h>
+
+#include "profile.hpp"
+
+Profile* Profile::active_ = nullptr;
+
+volatile sig_atomic_t Profile::pc = -1;
+
+
+Profile::Profile() :
+    executions(numStates),
+    pending(numStates),
+    samples(numStates),
+    total_samples(0),
+    cpu_ms(0),
+    started_ms(0),
+    gets(gridH * gridW),
+    puts(gridH * gridW)
+{
+}
+
+
+Profile::~Profile()
+{
+    if (active_ == this) stop();
+}
+
+
+static double cpu_time_ms()
+{
+    timespec t;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+
+void Profile::on_sample(int)
+{
+    int state = pc;
+    if (!active_ || state < 0) return;
+
+    active_->pending[state].fetch_add(1, std::memory_order_relaxed);
+    active_->total_samples.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+void Profile::start()
+{
+    active_ = this;
+    pc = -1;
+    started_ms = cpu_time_ms();
+
+    struct sigaction sa = {};
+    sa.sa_handler = on_sample;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, nullptr);
+
+    itimerval timer = {{0, PERIOD_US}, {0, PERIOD_US}};
+    setitimer(ITIMER_PROF, &timer, nullptr);
+}
+
+
+void Profile::stop()
+{
+    itimerval timer = {{0, 0}, {0, 0}};
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    if (active_ == this) cpu_ms += cpu_time_ms() - started_ms;
+    active_ = nullptr;
+}
+
+
+void Profile::fold(Trace& t, int state)
+{
+    for (int s : t.walk.states) executions[s] += t.walk.runs;
+    t.walk.runs = 0;
+
+    for (Walk& w : t.exit_walks)
+    {
+        for (int s : w.states) executions[s] += w.runs;
+        w.runs = 0;
+    }
+
+    // Where the trace spends its time is not sampled, so it is shared evenly by its states
+    // The samples are taken all at once, since the handler may add to them meanwhile
+    if (t.walk.states.empty() || pending[state].load(std::memory_order_relaxed) == 0) return;
+    uint64_t n = pending[state].exchange(0, std::memory_order_relaxed);
+
+    double share = (double) n / t.walk.states.size();
+    for (int s : t.walk.states) samples[s] += share;
+}
+
+
+uint64_t Profile::cell_executions(int cell) const
+{
+    uint64_t n = 0;
+    for (int d = 0; d < 4; d++) n += executions[cell * 4 + d];
+    return n;
+}
+
+
+// The samples left pending are of traces that are gone, they are counted at their entry
+double Profile::cell_samples(int cell) const
+{
+    double n = 0;
+    for (int d = 0; d < 4; d++) n += samples[cell * 4 + d] + pending[cell * 4 + d].load(std::memory_order_relaxed);
+    return n;
+}
+
+
+void Profile::write_json(std::ostream& out, CodeGrid<char>& code)
+{
+    static const char* const dir_names[] = {"right", "down", "left", "up"};
+
+    out << "{\n  \"width\": " << gridW << ",\n  \"height\": " << gridH << ",\n"
+        << "  \"sample_period_us\": " << PERIOD_US << ",\n  \"samples\": " << total_samples << ",\n"
+        << "  \"cpu_ms\": " << cpu_ms << ",\n";
+
+    out << "  \"code\": [";
+    for (int y = 0; y < gridH; y++)
+    {
+        out << (y ? ",\n    \"" : "\n    \"");
+        for (int x = 0; x < gridW; x++)
+        {
+            unsigned char c = code(y, x);
+            if (c == '"' || c == '\\') out << '\\' << c;
+            else if (c >= 0x20 && c < 0x7f) out << c;
+            else
+            {
+                char escaped[8];
+                std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out << escaped;
+            }
+        }
+        out << '"';
+    }
+    out << "\n  ],\n";
+
+    out << "  \"cells\": [";
+    bool first = true;
+    for (int cell = 0; cell < gridH * gridW; cell++)
+    {
+        double time_ms = total_samples ? cell_samples(cell) * cpu_ms / total_samples : 0;
+        if (!cell_executions(cell) && !time_ms && !gets[cell] && !puts[cell]) continue;
+
+        Position p = Position::from_index(cell);
+        out << (first ? "\n" : ",\n") << "    {\"x\": " << p.x() << ", \"y\": " << p.y() << ", \"executions\": {";
+        for (int d = 0; d < 4; d++) out << (d ? ", \"" : "\"") << dir_names[d] << "\": " << executions[cell * 4 + d];
+        out << "}, \"time_ms\": " << time_ms << ", \"gets\": " << gets[cell] << ", \"puts\": " << puts[cell] << "}";
+        first = false;
+    }
+    out << "\n  ]\n}\n";
+}
+
+
+void Profile::write_heatmap(std::ostream& out, CodeGrid<char>& code)
+{
+    // Background colors of the 256-color palette from cold to hot
+    static const int colors[] = {17, 19, 27, 36, 78, 148, 220, 208, 202, 196};
+    constexpr int levels = sizeof(colors) / sizeof(colors[0]);
+
+    uint64_t most = 0;
+    for (int cell = 0; cell < gridH * gridW; cell++) most = std::max(most, cell_executions(cell));
+
+    for (int y = 0; y < gridH; y++)
+    {
+        int color = -1;
+        for (int x = 0; x < gridW; x++)
+        {
+            uint64_t n = cell_executions(Position(y, x).index());
+            char c = code(y, x);
+            if (c < 0x20 || c >= 0x7f) c = '?';
+
+            // Levels on a log scale, so that cold loops still stand out from dead code, -1 for cells never run
+            int level = -1;
+            if (n > 0) level = most > 1 ? (int) (std::log((double) n) / std::log((double) most) * (levels - 1)) : levels - 1;
+
+            if (level != color)
+            {
+                if (level < 0) out << "\x1b[0m";
+                else out << "\x1b[30;48;5;" << colors[std::min(level, levels - 1)] << 'm';
+                color = level;
+            }
+            out << c;
+        }
+        if (color >= 0) out << "\x1b[0m";
+        out << '\n';
+    }
+    out << "most executed cell: " << most << " times, " << total_samples << " samples over "
+        << cpu_ms << "ms of CPU time" << std::endl;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+#include <csignal>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+#include "grid.hpp"
+#include "trace.hpp"
+
+// Execution heatmap of --profile
+// Every (cell, direction) state counts the times the pc went through it, from the runs of the traces,
+// and the time spent there, from samples of the trace running taken by a CPU timer
+// Cells also count the g and p accesses made to them
+class Profile
+{
+private:
+    // Period of the samples
+    static constexpr int PERIOD_US = 1000;
+
+    // Profile being sampled, only one at a time since the timer belongs to the process
+    static Profile* active_;
+
+    // Entry state of the trace running, -1 outside of traces
+    static volatile sig_atomic_t pc;
+
+    std::vector<uint64_t> executions;
+
+    // Samples taken in the trace entered at each state that have not been spread over the trace yet
+    // Added to by the handler of the timer, which may run on any thread, and drained by fold
+    std::vector<std::atomic<uint64_t>> pending;
+
+    // Samples of each state
+    std::vector<double> samples;
+
+    std::atomic<uint64_t> total_samples;
+
+    // CPU time of the process while the timer ran, which the samples share, since the timer may fire
+    // less often than asked for
+    double cpu_ms;
+    double started_ms;
+
+    std::vector<uint64_t> gets;
+    std::vector<uint64_t> puts;
+
+    static void on_sample(int);
+
+    // Executions of each cell, all directions together
+    uint64_t cell_executions(int cell) const;
+
+    double cell_samples(int cell) const;
+
+public:
+    Profile();
+
+    ~Profile();
+
+    Profile(const Profile&) = delete;
+    Profile& operator=(const Profile&) = delete;
+
+    static Profile* active() { return active_; }
+
+    // Starts and stops the timer of the samples
+    void start();
+
+    void stop();
+
+    // The trace entered at state is run
+    void enter(Trace& t, int state)
+    {
+        t.walk.runs++;
+        pc = state;
+    }
+
+    // Outside of traces, until the next one is entered
+    static void leave() { pc = -1; }
+
+    // A branch of the trace running goes to its exit in the direction of index i
+    void branch(Trace& t, int i) { t.exit_walks[i].runs++; }
+
+    void get(int64_t y, int64_t x) { if (CodeGrid<char>::inside(y, x)) gets[Position(y, x).index()]++; }
+
+    void put(int64_t y, int64_t x) { if (CodeGrid<char>::inside(y, x)) puts[Position(y, x).index()]++; }
+
+    // Takes the runs of trace t entered at state, and spreads its samples over the states it walks
+    void fold(Trace& t, int state);
+
+    // Writes the profile as JSON, along with the code
+    void write_json(std::ostream& out, CodeGrid<char>& code);
+
+    // Writes the code colored by the executions of each cell for a terminal
+    void write_heatmap(std::ostream& out, CodeGrid<char>& code);
+};
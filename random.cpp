@@ -0,0 +1,6 @@
+#include "random.hpp"
+
+__thread Random::State Random::state =
+{
+    {seed_word(DEFAULT_SEED, 0), seed_word(DEFAULT_SEED, 1), seed_word(DEFAULT_SEED, 2), seed_word(DEFAULT_SEED, 3)}
+};
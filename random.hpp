@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+
+//Singleton class for the random numbers of ?, a xoshiro256** generator
+//Every thread has a generator of its own, seeded with DEFAULT_SEED until a Vm swaps in another
+class Random
+{
+public:
+    static constexpr uint64_t DEFAULT_SEED = 0;
+
+    struct State
+    {
+        uint64_t s[4];
+    };
+
+private:
+    static __thread State state;
+
+    static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+    // The steps of splitmix64 after the increment, one expression each so that seeds fold to constants
+    static constexpr uint64_t mix(uint64_t z) { return mix2((z ^ (z >> 30)) * 0xbf58476d1ce4e5b9); }
+
+    static constexpr uint64_t mix2(uint64_t z) { return mix3((z ^ (z >> 27)) * 0x94d049bb133111eb); }
+
+    static constexpr uint64_t mix3(uint64_t z) { return z ^ (z >> 31); }
+
+public:
+    Random() = delete;
+
+    // Word k of the state seeded from seed, the output k of a splitmix64 generator started at seed,
+    // so that close seeds give unrelated sequences and the state is never all zeroes
+    static constexpr uint64_t seed_word(uint64_t seed, int k)
+    {
+        return mix(seed + (k + 1) * 0x9e3779b97f4a7c15);
+    }
+
+    static State create(uint64_t seed)
+    {
+        return State{{seed_word(seed, 0), seed_word(seed, 1), seed_word(seed, 2), seed_word(seed, 3)}};
+    }
+
+    // Makes s the generator, returns the generator it replaces
+    static State swap(const State& s)
+    {
+        State old = state;
+        state = s;
+        return old;
+    }
+
+    static uint64_t next()
+    {
+        uint64_t* s = state.s;
+        uint64_t result = rotl(s[1] * 5, 7) * 9;
+        uint64_t t = s[1] << 17;
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+        return result;
+    }
+
+    // 0 to 3, from the high bits, which are the most random
+    static int dir() { return next() >> 62; }
+};
@@ -0,0 +1,192 @@
+#include <csetjmp>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "snapshot.hpp"
+#include "heap.hpp"
+#include "trap.hpp"
+
+constexpr char Snapshot::MAGIC[8];
+
+
+bool Snapshot::write(const char* path, CodeGrid<char>& code, int state, const Random::State& random,
+    const Stack::State& stack)
+{
+    // Cells in the order they are written, found depth first from the stack
+    // A cell is only written once the cells it points to are, cells never form cycles since they never change
+    std::vector<block*> cells;
+    std::unordered_map<block*, int64_t> index;
+    std::vector<block*> pending;
+
+    for (bef_t* s = stack.stack; s <= stack.sp; s++)
+    {
+        if (is_ptr(*s)) pending.push_back(s->ptr);
+
+        while (!pending.empty())
+        {
+            block* b = pending.back();
+            if (index.count(b))
+            {
+                pending.pop_back();
+                continue;
+            }
+
+            bef_t fields[] = {Heap::head(bef_t{.ptr = b}), Heap::tail(bef_t{.ptr = b})};
+            bool ready = true;
+            for (bef_t f : fields)
+                if (is_ptr(f) && !index.count(f.ptr))
+                {
+                    pending.push_back(f.ptr);
+                    ready = false;
+                }
+
+            if (ready)
+            {
+                index[b] = cells.size();
+                cells.push_back(b);
+                pending.pop_back();
+            }
+        }
+    }
+
+    auto encode = [&] (bef_t v) { return is_ptr(v) ? index[v.ptr] << 2 | CELL_TAG : v.i; };
+
+    std::string temp = std::string(path) + ".tmp";
+    std::ofstream out(temp, std::ios::binary);
+
+    Header h = {};
+    std::memcpy(h.magic, MAGIC, sizeof(MAGIC));
+    h.version = VERSION;
+    h.width = gridW;
+    h.height = gridH;
+    h.state = state;
+    h.stack_size = stack.sp + 1 - stack.stack;
+    h.cells = cells.size();
+    std::memcpy(h.random, random.s, sizeof(h.random));
+    out.write((const char*) &h, sizeof(h));
+
+    for (int y = 0; y < gridH; y++)
+        for (int x = 0; x < gridW; x++) out.put(code(y, x));
+
+    for (bef_t* s = stack.stack; s <= stack.sp; s++)
+    {
+        int64_t v = encode(*s);
+        out.write((const char*) &v, sizeof(v));
+    }
+
+    for (block* b : cells)
+    {
+        int64_t fields[] = {encode(Heap::head(bef_t{.ptr = b})), encode(Heap::tail(bef_t{.ptr = b}))};
+        out.write((const char*) fields, sizeof(fields));
+    }
+
+    out.close();
+    if (!out || std::rename(temp.c_str(), path) != 0)
+    {
+        std::remove(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+bool Snapshot::read(const char* path, CodeGrid<char>& code, int& state, Random::State& random, size_t stack_limit,
+    std::string& error)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        if (fd >= 0) close(fd);
+        error = "Opening snapshot fail";
+        return false;
+    }
+
+    size_t size = st.st_size;
+    void* data = size >= sizeof(Header) ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        error = "Not a snapshot";
+        return false;
+    }
+
+    const Header* h = (const Header*) data;
+    const char* grid = (const char*) (h + 1);
+    const int64_t* values = (const int64_t*) (grid + gridH * gridW);
+    const int64_t* fields = values + h->stack_size;
+
+    // The sizes are checked one at a time, so that a corrupt one cannot overflow the total
+    size_t room = (size - sizeof(Header) - gridH * gridW) / sizeof(int64_t);
+    bool valid = size >= sizeof(Header) + gridH * gridW && std::memcmp(h->magic, MAGIC, sizeof(MAGIC)) == 0
+        && h->version == VERSION && h->width == gridW && h->height == gridH
+        && h->state >= 0 && h->state < numStates
+        && h->stack_size <= room && h->cells <= (room - h->stack_size) / 2;
+
+    // Cells only point to the cells before them
+    std::vector<bef_t> cells;
+    auto decode = [&] (int64_t v, bool& ok) {
+        if (!is_cell(v)) return bef_t{.i = v};
+        ok = ok && (uint64_t) (v >> 2) < cells.size();
+        return ok ? cells[v >> 2] : int2bef(0);
+    };
+
+    if (valid && h->stack_size > stack_limit)
+    {
+        munmap(data, size);
+        error = "Snapshot does not fit the stack";
+        return false;
+    }
+
+    if (valid)
+    {
+        madvise(data, size, MADV_SEQUENTIAL);
+
+        // Running out of memory jumps back here instead of to the Vm or the end of the process,
+        // so that the snapshot is unmapped and the failure returned
+        sigjmp_buf trap;
+        sigjmp_buf* outer_trap = Trap::target();
+        Trap::target() = &trap;
+        if (sigsetjmp(trap, 1) != 0)
+        {
+            Trap::target() = outer_trap;
+            munmap(data, size);
+            error = "Not enough memory";
+            return false;
+        }
+        Heap::reserve_old(h->cells);
+        Trap::target() = outer_trap;
+        cells.reserve(h->cells);
+        for (uint64_t k = 0; k < h->cells && valid; k++)
+        {
+            bef_t head = decode(fields[2 * k], valid);
+            bef_t tail = decode(fields[2 * k + 1], valid);
+            cells.push_back(Heap::old_cell(head, tail));
+        }
+
+        for (uint64_t k = 0; k < h->stack_size && valid; k++) Stack::push(decode(values[k], valid));
+    }
+
+    if (!valid)
+    {
+        munmap(data, size);
+        error = "Not a snapshot";
+        return false;
+    }
+
+    for (int y = 0; y < gridH; y++)
+        for (int x = 0; x < gridW; x++) code(y, x) = grid[y * gridW + x];
+    state = h->state;
+    std::memcpy(random.s, h->random, sizeof(random.s));
+
+    munmap(data, size);
+    return true;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "grid.hpp"
+#include "random.hpp"
+#include "stack.hpp"
+
+//Singleton class for the snapshot files of --checkpoint-every and --restore
+//A snapshot holds the code, the state of the pc and of the generator of ?, the stack and the cells the stack reaches,
+//with pointers written as indices of cells, so that it does not depend on where the heap is mapped
+//Cells are written after the cells they point to, so that they can be made in order
+class Snapshot
+{
+private:
+    static constexpr char MAGIC[8] = {'B', 'E', 'F', '+', 'S', 'N', 'A', 'P'};
+    static constexpr uint32_t VERSION = 2;
+
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t width;
+        uint32_t height;
+        int32_t state;
+        uint64_t stack_size;
+        uint64_t cells;
+        uint64_t random[4];
+    };
+
+    // Values are written with their tag, pointers as the index of the cell shifted by 2 and tagged 0b10,
+    // which integers never are
+    static constexpr int64_t CELL_TAG = 0b10;
+
+    static bool is_cell(int64_t v) { return (v & 0b11) == CELL_TAG; }
+
+public:
+    Snapshot() = delete;
+
+    // Writes the snapshot to path, through a temporary file renamed over it once complete
+    // The heap of the stack has to be swapped in
+    static bool write(const char* path, CodeGrid<char>& code, int state, const Random::State& random,
+        const Stack::State& stack);
+
+    // Reads the code, the state of the pc and the generator of the snapshot at path, and makes its cells and stack
+    // in the heap and the stack swapped in, which has to be empty and to hold stack_limit values
+    // Returns false with a message in error if it is not a snapshot, or its stack or its cells do not fit
+    static bool read(const char* path, CodeGrid<char>& code, int& state, Random::State& random, size_t stack_limit,
+        std::string& error);
+};
@@ -1,5 +1,112 @@
+#include <algorithm>
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include "stack.hpp"
+#include "trap.hpp"
+
+// Bytes of guard above the top, enough for the pushes of a compiled trace past the last element
+static constexpr size_t GUARD_SIZE = 64 << 10;
+
+// Reservation of the current stack, with the read-only page below the base and the guard
+static __thread char* region = nullptr;
+static __thread size_t region_size = 0;
+static __thread char* guard = nullptr;
+
+// Handler of SIGSEGV before the overflow handler was installed
+static struct sigaction previous;
+
+
+// Pushing past the top faults in the guard, any other fault is passed to the handler replaced
+static void on_segv(int sig, siginfo_t* info, void* context)
+{
+    char* addr = (char*) info->si_addr;
+    if (!guard || addr < guard || addr >= guard + GUARD_SIZE)
+    {
+        if (previous.sa_flags & SA_SIGINFO) previous.sa_sigaction(sig, info, context);
+        else if (previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN) previous.sa_handler(sig);
+        else
+        {
+            // The fault comes back once the handler returns, to the default action
+            signal(sig, SIG_DFL);
+        }
+        return;
+    }
+
+    Trap::raise(Fault::Stack_overflow);
+
+    // Only system calls from here, the writer thread is drained rather than handed the buffer
+    Output::flush_from_signal();
+    static const char message[] = "Stack overflow\n";
+    if (write(STDERR_FILENO, message, sizeof(message) - 1) < 0) {}
+    _exit(1);
+}
+
+
+// Installs the overflow handler, once the first stack is made rather than in every program linking the runtime
+static bool install()
+{
+    struct sigaction sa = {};
+    sa.sa_sigaction = on_segv;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, &previous);
+    return true;
+}
+
+
+Stack::State Stack::create(size_t bytes)
+{
+    static const bool installed = install();
+    (void) installed;
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t n = (std::max(bytes, sizeof(bef_t)) + page - 1) / page * page;
+
+    State s;
+    s.region_size = page + n + GUARD_SIZE;
+
+    // The pages are only committed once they are touched
+    void* p = mmap(nullptr, s.region_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+    {
+        std::cerr << "Could not reserve the stack" << std::endl;
+        exit(1);
+    }
+
+    s.region = (char*) p;
+    s.guard = s.region + page + n;
+    s.stack = (bef_t*) (s.region + page);
+    s.sp = s.stack - 1;
+    s.stack[-1] = int2bef(0);
+    mprotect(s.region, page, PROT_READ);
+    mprotect(s.guard, GUARD_SIZE, PROT_NONE);
+
+    return s;
+}
+
+
+void Stack::destroy(const State& s)
+{
+    munmap(s.region, s.region_size);
+}
+
+
+Stack::State Stack::swap(const State& s)
+{
+    State old = { stack, sp, region, region_size, guard };
+    stack = s.stack;
+    sp = s.sp;
+    region = s.region;
+    region_size = s.region_size;
+    guard = s.guard;
+    return old;
+}
+
 
 // Initialization of static member variables
-bef_t Stack::stack[Stack::STACK_SIZE];
-bef_t* Stack::sp = stack - 1;
\ No newline at end of file
+__thread bef_t* Stack::stack = nullptr;
+__thread bef_t* Stack::sp = nullptr;
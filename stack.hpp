@@ -1,26 +1,65 @@
 #pragma once
 
+#include <cstring>
+
 #include "bef_type.hpp"
 
 //Singleton class for Stack operations
 class Stack
 {
 friend class Heap;
+friend class Jit;
 
-private:
-    static constexpr size_t STACK_SIZE = ((1<<20) * sizeof(int64_t)) / sizeof(bef_t);
+public:
+    // Default limit of the stack in bytes, only the pages in use are committed
+    static constexpr size_t DEFAULT_SIZE = (1<<20) * sizeof(int64_t);
 
-    static bef_t stack[STACK_SIZE];
+    // A reservation and the stack pointer into it, so that several stacks can take turns, see Vm
+    struct State
+    {
+        bef_t* stack;
+        bef_t* sp;
+        char* region;
+        size_t region_size;
+        char* guard;
+    };
+
+private:
+    // Base of the stack
+    // The page below it is read-only and holds a 0 right under the base, and the pages above the top
+    // are a guard whose access is reported as a stack overflow
+    // Every thread has a stack of its own, none until one is swapped in, see Vm
+    static __thread bef_t* stack;
 
     // Stack pointer
-    static bef_t* sp;
+    static __thread bef_t* sp;
 
 public:
     Stack() = delete;
 
+    // Reserves an empty stack with room for the given number of bytes
+    static State create(size_t bytes);
+
+    static void destroy(const State& s);
+
+    // Makes s the stack, returns the stack it replaces
+    static State swap(const State& s);
+
     static void push(bef_t b) { *(++sp) = b; }
 
-    static bef_t pop() { return (sp - stack < 0) ? int2bef(0) : *(sp--); }
+    // Pushes n values in order with one copy
+    // n must keep the copy within the guard, so that an overflow still runs into it
+    static void push_all(const bef_t* values, size_t n)
+    {
+        std::memcpy(sp + 1, values, n * sizeof(bef_t));
+        sp += n;
+    }
+
+    // An empty stack reads the 0 under its base, and sp stays there without a branch
+    static bef_t pop() { bef_t b = *sp; sp -= (sp >= stack); return b; }
+
+    static bef_t head() { return *sp; }
 
-    static bef_t head() { return (sp - stack < 0) ? int2bef(0) : *sp; }
+    // Number of values in memory, which the interpreter keeps one more above, see Interpreter::execute
+    static size_t depth() { return sp + 1 - stack; }
 };
@@ -0,0 +1,257 @@
+#include <algorithm>
+#include <csignal>
+#include <cstdarg>
+#include <cstdio>
+
+#include <unistd.h>
+
+#include "output.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
+
+namespace {
+
+// Collections whose details are kept for the report, the earlier ones only count in the totals
+constexpr size_t KEPT_COLLECTIONS = 32;
+
+struct Collection
+{
+    uint64_t mark_ns;
+    uint64_t sweep_ns;
+    size_t live;
+    size_t free;
+    size_t size;
+};
+
+struct Counters
+{
+    uint64_t start_ns;
+
+    uint64_t ops[Num_instrs];
+    uint64_t walked;
+    uint64_t compiled;
+
+    uint64_t puts;
+    uint64_t changed;
+    uint64_t dropping;
+    uint64_t dropped;
+
+    uint64_t collections;
+    uint64_t mark_ns;
+    uint64_t sweep_ns;
+    Collection kept[KEPT_COLLECTIONS];
+
+    uint64_t nurseries;
+    uint64_t nursery_ns;
+
+    uint64_t output_bytes;
+    uint64_t output_ns;
+    uint64_t input_bytes;
+    uint64_t input_ns;
+};
+
+__thread Counters counters;
+
+// Counters of the thread that called start
+Counters* reported = nullptr;
+
+const char* const instr_names[] =
+{
+    "Add", "Sub", "Mul", "Div", "Mod", "Not", "Grt", "Dup", "Swap", "Pop", "Print_int", "Print_char",
+    "Get", "In_int", "In_char", "Cell", "Head", "Tail", "List_len", "List_nth", "List_rev", "List_build",
+    "List_spill", "Head_cell", "Tail_cell", "Push", "Push_str", "Add_imm", "Sub_imm", "Mul_imm", "Div_imm", "Mod_imm", "Grt_imm", "Nop",
+    "Exec", "Exec_num", "Exec_str", "Jump", "Pc_rand", "Horif", "Verif", "Put", "End", "Unk"
+};
+static_assert(sizeof(instr_names) / sizeof(instr_names[0]) == Num_instrs, "a name is missing");
+
+// The report is formatted with snprintf into a static buffer
+char text[16384];
+size_t length;
+
+__attribute__((format(printf, 1, 2)))
+void add(const char* fmt, ...)
+{
+    if (length >= sizeof(text)) return;
+
+    va_list args;
+    va_start(args, fmt);
+    length += std::vsnprintf(text + length, sizeof(text) - length, fmt, args);
+    va_end(args);
+}
+
+
+size_t format(const Counters& c)
+{
+    length = 0;
+    auto ms = [] (uint64_t ns) { return ns / 1e6; };
+    auto share = [] (uint64_t part, uint64_t whole) { return whole ? 100.0 * part / whole : 0.0; };
+
+    uint64_t total_ns = Stats::now() - c.start_ns;
+    uint64_t ops = 0;
+    for (uint64_t k : c.ops) ops += k;
+    uint64_t gc_ns = c.mark_ns + c.sweep_ns + c.nursery_ns;
+    uint64_t io_ns = c.output_ns + c.input_ns;
+
+    add("--- stats ---\n");
+    add("time              %.3f ms\n", ms(total_ns));
+    add("  gc              %.3f ms (%.1f%%)\n", ms(gc_ns), share(gc_ns, total_ns));
+    add("  i/o             %.3f ms (%.1f%%)\n", ms(io_ns), share(io_ns, total_ns));
+    add("  rest            %.3f ms (%.1f%%)\n", ms(total_ns - std::min(total_ns, gc_ns + io_ns)),
+        share(total_ns - std::min(total_ns, gc_ns + io_ns), total_ns));
+    add("operations        %llu\n", (unsigned long long) ops);
+    add("cells walked      %llu\n", (unsigned long long) c.walked);
+    add("traces compiled   %llu\n", (unsigned long long) c.compiled);
+    add("p writes          %llu, %llu changing their cell, %llu dropping traces (%llu traces dropped)\n",
+        (unsigned long long) c.puts, (unsigned long long) c.changed,
+        (unsigned long long) c.dropping, (unsigned long long) c.dropped);
+
+    add("operations by instruction\n");
+    for (int i = 0; i < Num_instrs; i++)
+        if (c.ops[i])
+            add("  %-12s %14llu %6.2f%%\n", instr_names[i], (unsigned long long) c.ops[i], share(c.ops[i], ops));
+
+    add("collections       %llu, mark %.3f ms, sweep %.3f ms\n",
+        (unsigned long long) c.collections, ms(c.mark_ns), ms(c.sweep_ns));
+    if (c.collections)
+    {
+        uint64_t first = c.collections > KEPT_COLLECTIONS ? c.collections - KEPT_COLLECTIONS : 0;
+        if (first) add("  (%llu earlier collections left out)\n", (unsigned long long) first);
+        add("  %8s %12s %12s %12s %12s %12s\n", "#", "mark(us)", "sweep(us)", "live", "free", "blocks");
+        for (uint64_t k = first; k < c.collections; k++)
+        {
+            const Collection& g = c.kept[k % KEPT_COLLECTIONS];
+            add("  %8llu %12.1f %12.1f %12zu %12zu %12zu\n", (unsigned long long) k + 1,
+                g.mark_ns / 1e3, g.sweep_ns / 1e3, g.live, g.free, g.size);
+        }
+    }
+    if (c.nurseries)
+        add("nursery           %llu collections, %.3f ms\n", (unsigned long long) c.nurseries, ms(c.nursery_ns));
+
+    add("output            %llu bytes, %.3f ms\n", (unsigned long long) c.output_bytes, ms(c.output_ns));
+    add("input             %llu bytes, %.3f ms\n", (unsigned long long) c.input_bytes, ms(c.input_ns));
+
+    return std::min(length, sizeof(text));
+}
+
+
+void write_report(const Counters& c)
+{
+    size_t n = format(c);
+    for (size_t done = 0; done < n; )
+    {
+        ssize_t w = write(STDERR_FILENO, text + done, n - done);
+        if (w <= 0) break;
+        done += w;
+    }
+}
+
+
+// Set by SIGINT, the report is written at the next trace entered, since formatting it is not signal-safe
+volatile sig_atomic_t interrupted = 0;
+
+// Handler of SIGINT before start, which a second SIGINT goes to, for a program that enters no more traces
+struct sigaction previous;
+
+void on_sigint(int)
+{
+    interrupted = 1;
+    sigaction(SIGINT, &previous, nullptr);
+}
+
+
+void report_and_exit()
+{
+    if (reported) write_report(*reported);
+    Output::close();
+    _exit(130);
+}
+
+}
+
+
+void Stats::enter(const Trace& t)
+{
+    if (interrupted) report_and_exit();
+    for (const TraceOp& op : t.ops) counters.ops[op.instr]++;
+    counters.walked += t.walk.cells;
+}
+
+
+void Stats::walk(unsigned cells)
+{
+    counters.walked += cells;
+}
+
+
+void Stats::compile()
+{
+    counters.compiled++;
+}
+
+
+void Stats::put()
+{
+    counters.puts++;
+}
+
+
+void Stats::rewrite(size_t dropped)
+{
+    counters.changed++;
+    counters.dropping += dropped > 0;
+    counters.dropped += dropped;
+}
+
+
+void Stats::mark(uint64_t ns, size_t live, size_t free, size_t size)
+{
+    counters.kept[counters.collections % KEPT_COLLECTIONS] = Collection{ns, 0, live, free, size};
+    counters.collections++;
+    counters.mark_ns += ns;
+}
+
+
+void Stats::sweep(uint64_t ns)
+{
+    counters.sweep_ns += ns;
+    if (counters.collections) counters.kept[(counters.collections - 1) % KEPT_COLLECTIONS].sweep_ns += ns;
+}
+
+
+void Stats::nursery(uint64_t ns)
+{
+    counters.nurseries++;
+    counters.nursery_ns += ns;
+}
+
+
+void Stats::output(size_t bytes, uint64_t ns)
+{
+    counters.output_bytes += bytes;
+    counters.output_ns += ns;
+}
+
+
+void Stats::input(size_t bytes, uint64_t ns)
+{
+    counters.input_bytes += bytes;
+    counters.input_ns += ns;
+}
+
+
+void Stats::start()
+{
+    counters.start_ns = now();
+    reported = &counters;
+
+    struct sigaction sa = {};
+    sa.sa_handler = on_sigint;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, &previous);
+}
+
+
+void Stats::report()
+{
+    if (reported) write_report(*reported);
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+struct Trace;
+
+// Runs statement only in builds made with make STATS=1, so that the counters cost nothing otherwise
+#ifdef BEF_STATS
+#define STATS(statement) statement
+#else
+#define STATS(statement)
+#endif
+
+//Singleton class for the runtime statistics of --stats
+//Every thread counts for itself, the report is of the thread that called start
+class Stats
+{
+public:
+    Stats() = delete;
+
+#ifdef BEF_STATS
+    static constexpr bool compiled = true;
+#else
+    static constexpr bool compiled = false;
+#endif
+
+    static uint64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Trace t is entered, its operations are counted as run, and the cells walked up to its exit
+    static void enter(const Trace& t);
+
+    // Cells walked from a branch to the trace it leads to
+    static void walk(unsigned cells);
+
+    static void compile();
+
+    static void put();
+
+    // A p write that changed its cell, which dropped the given number of traces
+    static void rewrite(size_t dropped);
+
+    // A mark phase, and the state of the old space it left, in blocks
+    static void mark(uint64_t ns, size_t live, size_t free, size_t size);
+
+    // Sweeping after the last mark phase
+    static void sweep(uint64_t ns);
+
+    // Copying of a nursery collection, not counting the collection of the old space it may start
+    static void nursery(uint64_t ns);
+
+    static void output(size_t bytes, uint64_t ns);
+
+    static void input(size_t bytes, uint64_t ns);
+
+    // Starts the clock of the report, which SIGINT then has written at the next trace entered, before the process
+    // ends with the output flushed. A second SIGINT goes to the handler it had before
+    static void start();
+
+    // Writes the report of the thread that called start to the standard error
+    static void report();
+};
@@ -0,0 +1,5 @@
+0"Befunge with cons cells"0:c>\:     #v_$v
+                                      c
+                             ^    $c::<
+                                         >:t:#v_$$@
+                                         ^  h,<
@@ -0,0 +1,4 @@
+0:c"}}"*4*>\1c\::c$::c$::c$::c$::c$::c$::c$1-:v
+          ^                                   _$0\>:t1-v
+                                                    @.$_h\1+\v
+                                                  ^          <
@@ -0,0 +1,4 @@
+&.55+,&.55+,&.55+,&.55+,&.55+,&.55+,&.55+,&.55+,v
+v                                               <
+>~:1+#v_.@
+^    ,<
@@ -0,0 +1,4 @@
+123 3b:l.:0n.:2n.:9n.r:0n.s....57cr:t.h.9l.90n.v
+v                                              <
+>"}"8*>:1-:v
+      ^    _$"}"8*b:l.:0n.:"c"n.r:"c"n.sb:l.:"}"8*1-n.@
@@ -0,0 +1 @@
+123 3b:l.9nh@
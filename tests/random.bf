@@ -0,0 +1,5 @@
+"d"00p>00g1-:00p!#v_v
+                  @
+                  v0?1v
+                    2
+      ^.          < < <
@@ -0,0 +1,540 @@
+#include <algorithm>
+#include <utility>
+
+#include "trace.hpp"
+#include "stats.hpp"
+#include "profile.hpp"
+#include "jit.hpp"
+
+constexpr int Facts::MAX_DEPTH;
+
+// Characters of the list operations of --lists
+static const std::pair<char, Instr> list_instrs[] =
+{
+    {'l', List_len}, {'n', List_nth}, {'r', List_rev}, {'b', List_build}, {'s', List_spill}
+};
+
+static Instr list_instr(char c)
+{
+    for (auto& l : list_instrs)
+        if (l.first == c) return l.second;
+    return Unk;
+}
+
+
+bool Facts::operator==(const Facts& other) const
+{
+    return depth == other.depth && std::equal(kinds, kinds + KNOWN, other.kinds);
+}
+
+
+Facts Facts::meet(const Facts& a, const Facts& b)
+{
+    Facts f;
+    f.depth = std::min(a.depth, b.depth);
+    for (int k = 0; k < KNOWN; k++) f.kinds[k] = a.kinds[k] == b.kinds[k] ? a.kinds[k] : Kind::Any;
+    return f;
+}
+
+
+void Facts::push(Kind k)
+{
+    std::copy_backward(kinds, kinds + KNOWN - 1, kinds + KNOWN);
+    kinds[0] = k;
+    depth = std::min(depth + 1, MAX_DEPTH);
+}
+
+
+// A value below depth may be the 0 of an empty stack or anything else
+Kind Facts::pop()
+{
+    Kind k = kinds[0];
+    std::copy(kinds + 1, kinds + KNOWN, kinds);
+    kinds[KNOWN - 1] = Kind::Any;
+    depth = std::max(depth - 1, 0);
+    return k;
+}
+
+
+void Facts::apply(const TraceOp& op, bool list_ops)
+{
+    switch (op.instr)
+    {
+        // Adding to a cell makes a pointer into the heap, so the tag of the result is only known for integers
+        case Add:
+        case Sub:
+        {
+            Kind b = pop(), a = pop();
+            push(a == Kind::Int && b == Kind::Int ? Kind::Int : Kind::Any);
+            break;
+        }
+        case Add_imm:
+        case Sub_imm:
+            push(pop() == Kind::Int ? Kind::Int : Kind::Any);
+            break;
+        case Mul:
+        case Div:
+        case Mod:
+        case Grt:
+        case Get:
+        case List_nth:
+            pop();
+            pop();
+            push(op.instr == List_nth ? Kind::Any : Kind::Int);
+            break;
+        case Mul_imm:
+        case Div_imm:
+        case Mod_imm:
+        case Grt_imm:
+        case Not:
+        case List_len:
+            pop();
+            push(Kind::Int);
+            break;
+        case Dup:
+        {
+            Kind a = pop();
+            push(a);
+            push(a);
+            break;
+        }
+        case Swap:
+        {
+            Kind b = pop(), a = pop();
+            push(b);
+            push(a);
+            break;
+        }
+        case Pop:
+        case Print_int:
+        case Print_char:
+        case Horif:
+        case Verif:
+            pop();
+            break;
+        case In_int:
+        case In_char:
+        case Push:
+        case Exec_num:
+        case Exec_str:
+            push(Kind::Int);
+            break;
+        case Push_str:
+            for (uint32_t k = 0; k < span_count(op.imm); k++) push(Kind::Int);
+            break;
+        case Cell:
+            pop();
+            pop();
+            push(Kind::Cell);
+            break;
+        case Head:
+        case Tail:
+        case Head_cell:
+        case Tail_cell:
+        case List_rev:
+            pop();
+            push(Kind::Any);
+            break;
+        case Put:
+            pop();
+            pop();
+            pop();
+            break;
+        // b and s pop a number of values known only at run time, they leave the list and the number
+        case List_build:
+            *this = Facts();
+            push(Kind::Any);
+            break;
+        case List_spill:
+            pop();
+            std::fill(kinds, kinds + KNOWN, Kind::Any);
+            push(Kind::Int);
+            break;
+        // Any simple instruction pops at most one value more than it pushes, but b
+        case Exec:
+        {
+            int d = list_ops ? std::min(depth - 1, 1) : depth - 1;
+            *this = Facts();
+            depth = std::max(d, 0);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+
+TraceCache::TraceCache(CodeGrid<char>& code, void* const* labels, bool list_ops) :
+    code(code), nav(code), labels(labels), traces(numStates), covering(gridH * gridW), writes(gridH * gridW),
+    list_ops(list_ops), facts(numStates), reached(numStates)
+{
+    for (void*& label : exec_labels) label = nullptr;
+
+    static const std::pair<char, Instr> simple[] =
+    {
+        {'+', Add}, {'-', Sub}, {'*', Mul}, {'/', Div}, {'%', Mod}, {'!', Not}, {'`', Grt},
+        {':', Dup}, {'\\', Swap}, {'$', Pop}, {'.', Print_int}, {',', Print_char}, {'g', Get},
+        {'&', In_int}, {'~', In_char}, {'c', Cell}, {'h', Head}, {'t', Tail}, {' ', Nop}
+    };
+    for (auto& s : simple) exec_labels[(unsigned char) s.first] = labels[s.second];
+    for (char c = '0'; c <= '9'; c++) exec_labels[(unsigned char) c] = labels[Exec_num];
+    if (list_ops)
+        for (auto& l : list_instrs) exec_labels[(unsigned char) l.first] = labels[l.second];
+}
+
+
+// Binary operations that have a version with an immediate rhs
+static bool has_imm(Instr instr) { return instr >= Add && instr <= Grt && instr != Not; }
+
+static Instr imm_version(Instr instr)
+{
+    switch (instr)
+    {
+        case Add: return Add_imm;
+        case Sub: return Sub_imm;
+        case Mul: return Mul_imm;
+        case Div: return Div_imm;
+        case Mod: return Mod_imm;
+        default:  return Grt_imm;
+    }
+}
+
+static bef_t apply(Instr instr, bef_t lhs, bef_t rhs)
+{
+    switch (instr)
+    {
+        case Add: return lhs + rhs;
+        case Sub: return lhs - rhs;
+        case Mul: return lhs * rhs;
+        case Div: return lhs / rhs;
+        case Mod: return lhs % rhs;
+        default:  return lhs > rhs;
+    }
+}
+
+
+Trace* TraceCache::compile(int entry)
+{
+    STATS(Stats::compile());
+
+    Trace* t = new Trace;
+    traces[entry].reset(t);
+
+    std::vector<std::pair<Instr, bef_t>> ops;
+    std::vector<bool> seen(numStates);
+    std::vector<int> cells;
+
+    auto visit = [&] (int cell) {
+        if (!t->cells[cell])
+        {
+            t->cells.set(cell);
+            cells.push_back(cell);
+        }
+    };
+
+    auto step = [&] (int state, Walk& walk) {
+        walk.cells++;
+        if (profile) walk.states.push_back(state);
+    };
+
+    // State of the next instruction after from, the cells skipped on the way are covered too
+    // The cells left behind, the one of from included, are added to walk
+    auto follow = [&] (int from, Walk& walk) {
+        int to = nav.next(from);
+        for (int s = from; s != to; s = nav.step(s)) visit(s / 4), step(s, walk);
+        visit(to / 4);
+        return to;
+    };
+
+    // Exit of the branch at pc towards dir
+    auto branch = [&] (Position pc, Direction dir) {
+        t->exits[dir_index(dir)] = follow(make_state(pc, dir), t->exit_walks[dir_index(dir)]);
+    };
+
+    auto emit = [&] (Instr instr, bef_t imm) { ops.emplace_back(instr, imm); };
+
+    // Binary operations whose operands are pushed by the trace itself are folded
+    auto emit_binary = [&] (Instr instr) {
+        size_t n = ops.size();
+        bool rhs_const = n >= 1 && ops[n - 1].first == Push;
+        bool divides = instr == Div || instr == Mod;
+
+        if (rhs_const && divides && bef2int(ops[n - 1].second) == 0) emit(instr, int2bef(0));
+        else if (rhs_const && n >= 2 && ops[n - 2].first == Push)
+        {
+            ops[n - 2].second = apply(instr, ops[n - 2].second, ops[n - 1].second);
+            ops.pop_back();
+        }
+        else if (rhs_const && has_imm(instr)) ops[n - 1].first = imm_version(instr);
+        else emit(instr, int2bef(0));
+    };
+
+    int state = entry;
+
+    while (true)
+    {
+        if (seen[state] || ops.size() >= MAX_OPS)
+        {
+            emit(Jump, int2bef(0));
+            t->next = state;
+            break;
+        }
+        seen[state] = true;
+
+        Position pc = state_pos(state);
+        Direction dir = state_dir(state);
+        char c = code(pc);
+        visit(pc.index());
+
+        if (is_volatile(pc.index()) && is_simple(c))
+        {
+            emit(Exec, bef_t{.i = pc.index()});
+            state = follow(state, t->walk);
+            continue;
+        }
+
+        bool exit = true;
+        switch (c)
+        {
+            case '>': dir = Direction::Right; exit = false; break;
+            case '<': dir = Direction::Left;  exit = false; break;
+            case '^': dir = Direction::Up;    exit = false; break;
+            case 'v': dir = Direction::Down;  exit = false; break;
+            // Only met at the entry, the navigator skips them otherwise
+            case ' ':
+            case '#':
+                exit = false;
+                break;
+            // The string always ends, at the latest when the pc wraps around to the opening quote
+            case '"':
+            {
+                int s;
+                step(state, t->walk);
+                for (s = nav.step(state); code(state_pos(s)) != '"'; s = nav.step(s))
+                {
+                    int cell = s / 4;
+                    step(s, t->walk);
+                    visit(cell);
+                    if (is_volatile(cell) && is_simple(code(state_pos(s)))) emit(Exec_str, bef_t{.i = cell});
+                    else emit(Push, char2bef(code(state_pos(s))));
+                }
+                visit(s / 4);
+                pc = state_pos(s);
+                exit = false;
+                break;
+            }
+            case '0'...'9': emit(Push, int2bef(c - '0')); exit = false; break;
+            case '+':  emit_binary(Add);          exit = false; break;
+            case '-':  emit_binary(Sub);          exit = false; break;
+            case '*':  emit_binary(Mul);          exit = false; break;
+            case '/':  emit_binary(Div);          exit = false; break;
+            case '%':  emit_binary(Mod);          exit = false; break;
+            case '`':  emit_binary(Grt);          exit = false; break;
+            case '!':
+                if (!ops.empty() && ops.back().first == Push) ops.back().second = !ops.back().second;
+                else emit(Not, int2bef(0));
+                exit = false;
+                break;
+            case ':':  emit(Dup, int2bef(0));        exit = false; break;
+            case '\\': emit(Swap, int2bef(0));       exit = false; break;
+            case '$':  emit(Pop, int2bef(0));        exit = false; break;
+            case '.':  emit(Print_int, int2bef(0));  exit = false; break;
+            case ',':  emit(Print_char, int2bef(0)); exit = false; break;
+            case 'g':  emit(Get, int2bef(0));        exit = false; break;
+            case '&':  emit(In_int, int2bef(0));     exit = false; break;
+            case '~':  emit(In_char, int2bef(0));    exit = false; break;
+            case 'c':  emit(Cell, int2bef(0));       exit = false; break;
+            case 'h':  emit(Head, int2bef(0));       exit = false; break;
+            case 't':  emit(Tail, int2bef(0));       exit = false; break;
+            case '_':
+                emit(Horif, int2bef(0));
+                branch(pc, Direction::Left);
+                branch(pc, Direction::Right);
+                break;
+            case '|':
+                emit(Verif, int2bef(0));
+                branch(pc, Direction::Up);
+                branch(pc, Direction::Down);
+                break;
+            case '?':
+                emit(Pc_rand, int2bef(0));
+                for (int i = 0; i < 4; i++) branch(pc, index_dir(i));
+                break;
+            // Put may change the code ahead, so the trace ends here
+            // and continues from the neighbouring cell, since the write may change the cells skipped after it
+            case 'p':
+                emit(Put, int2bef(0));
+                t->next = nav.step(state);
+                step(state, t->walk);
+                break;
+            case '@':  emit(End, int2bef(0));   step(state, t->walk); break;
+            default:
+                if (list_ops && list_instr(c) != Unk)
+                {
+                    emit(list_instr(c), int2bef(0));
+                    exit = false;
+                }
+                else
+                {
+                    emit(Unk, char2bef(c));
+                    step(state, t->walk);
+                }
+                break;
+        }
+
+        if (exit) break;
+
+        state = follow(make_state(pc, dir), t->walk);
+    }
+
+    // Runs of pushes, which string mode makes, are pushed with a single copy
+    // A trace has at most MAX_OPS operations and a string, so a run stays well within the guard of the stack
+    t->steps = ops.size();
+    for (size_t k = 0; k < ops.size(); k++)
+    {
+        size_t end = k;
+        while (end < ops.size() && ops[end].first == Push) end++;
+
+        if (end - k >= 2)
+        {
+            t->ops.push_back(TraceOp{labels[Push_str], str_span(t->literals.size(), end - k), Push_str});
+            for (; k < end; k++) t->literals.push_back(ops[k].second);
+            k--;
+        }
+        else t->ops.push_back(TraceOp{labels[ops[k].first], ops[k].second, ops[k].first});
+    }
+
+    // Head and Tail skip their check where the facts at the entry show a cell
+    // A state no start reaches is only compiled for a look at its operations, see emit_cpp
+    Facts f = reached[entry] ? facts[entry] : Facts();
+    t->depth = f.depth;
+    for (TraceOp& op : t->ops)
+    {
+        if ((op.instr == Head || op.instr == Tail) && f.kinds[0] == Kind::Cell)
+        {
+            op.instr = op.instr == Head ? Head_cell : Tail_cell;
+            op.label = labels[op.instr];
+        }
+        f.apply(op, list_ops);
+    }
+
+    for (int cell : cells)
+        if (covering[cell].empty() || covering[cell].back() != entry)
+            covering[cell].push_back(entry);
+
+    return t;
+}
+
+
+size_t TraceCache::invalidate(int y, int x, char old)
+{
+    int cell = Position(y, x).index();
+
+    nav.update(y, x, old);
+
+    // Exec operations pick up the new instruction by themselves
+    if (is_volatile(cell) && is_simple(old) && is_simple(code(y, x)))
+    {
+        STATS(Stats::rewrite(0));
+        return 0;
+    }
+
+    if (writes[cell] < UINT8_MAX) writes[cell]++;
+    if (is_volatile(cell)) nav.pin(cell);
+
+    size_t dropped = 0;
+    std::vector<int> queue;
+    for (int state : covering[cell])
+        if (traces[state] && traces[state]->cells[cell])
+        {
+            drop(state);
+            dropped++;
+            if (reached[state]) queue.push_back(state);
+        }
+
+    covering[cell].clear();
+    infer(queue);
+
+    STATS(Stats::rewrite(dropped));
+    return dropped;
+}
+
+
+void TraceCache::drop(int state)
+{
+    if (!traces[state]) return;
+    if (profile) profile->fold(*traces[state], state);
+    if (jit) jit->release(*traces[state]);
+    traces[state].reset();
+}
+
+
+void TraceCache::infer(std::vector<int>& queue)
+{
+    while (!queue.empty())
+    {
+        int state = queue.back();
+        queue.pop_back();
+
+        Trace* t = get(state);
+        Facts out = facts[state];
+        for (const TraceOp& op : t->ops) out.apply(op, list_ops);
+
+        int next[4];
+        int n = 0;
+        switch (t->ops.back().instr)
+        {
+            case Jump:
+            case Put:
+                next[n++] = t->next;
+                break;
+            case Horif:
+                next[n++] = t->exits[dir_index(Direction::Left)];
+                next[n++] = t->exits[dir_index(Direction::Right)];
+                break;
+            case Verif:
+                next[n++] = t->exits[dir_index(Direction::Up)];
+                next[n++] = t->exits[dir_index(Direction::Down)];
+                break;
+            case Pc_rand:
+                for (int i = 0; i < 4; i++) next[n++] = t->exits[i];
+                break;
+            default:
+                break;
+        }
+
+        // t may be dropped from here on, when it leads back to itself
+        for (int k = 0; k < n; k++)
+        {
+            int s = next[k];
+            Facts f = reached[s] ? Facts::meet(facts[s], out) : out;
+            if (reached[s] && f == facts[s]) continue;
+
+            reached[s] = true;
+            facts[s] = f;
+            drop(s);
+            queue.push_back(s);
+        }
+    }
+}
+
+
+void TraceCache::start(int state)
+{
+    if (reached[state]) return;
+
+    // Nothing is known of the stack a program starts or is restored with
+    reached[state] = true;
+    facts[state] = Facts();
+    drop(state);
+
+    std::vector<int> queue = {state};
+    infer(queue);
+}
+
+
+void TraceCache::fold()
+{
+    for (size_t state = 0; state < traces.size(); state++)
+        if (traces[state]) profile->fold(*traces[state], state);
+}
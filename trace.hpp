@@ -0,0 +1,251 @@
+#pragma once
+
+#include <bitset>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "bef_type.hpp"
+#include "grid.hpp"
+#include "nav.hpp"
+
+class Jit;
+class Profile;
+
+// Enum for the operations traces are compiled to
+// Spaces, bridges, direction changes and string mode are resolved by the compiler
+// so they have no operation of their own
+enum Instr
+{
+    Add,
+    Sub,
+    Mul,
+    Div,
+    Mod,
+    Not,
+    Grt,
+    Dup,
+    Swap,
+    Pop,
+    Print_int,
+    Print_char,
+    Get,
+    In_int,
+    In_char,
+    Cell,
+    Head,
+    Tail,
+    List_len,   // List operations of --lists, see Heap::length
+    List_nth,
+    List_rev,
+    List_build,
+    List_spill,
+    Head_cell,  // Head and Tail of a value proven to be a cell, which skip the check, see Facts
+    Tail_cell,
+    Push,    // Push the immediate
+    Push_str, // Push a span of the literals of the trace, see str_span
+    Add_imm, // The following ones pop a value and apply the operation with the immediate as rhs
+    Sub_imm,
+    Mul_imm,
+    Div_imm,
+    Mod_imm,
+    Grt_imm,
+    Nop,
+    Exec,     // Execute the cell whose index is the immediate, see TraceCache::exec
+    Exec_num, // Push the digit in the cell whose index is the immediate
+    Exec_str, // Push the character in the cell whose index is the immediate
+    // Trace exits
+    Jump,    // Continue with the trace at next
+    Pc_rand,
+    Horif,
+    Verif,
+    Put,     // Continue with the trace at next after the write
+    End,
+    Unk,     // Unknown instruction, the immediate is the character
+    Num_instrs
+};
+
+// Part of the path of a trace, for --stats and --profile
+struct Walk
+{
+    unsigned cells = 0;
+
+    // The states walked, only kept for a profile
+    std::vector<int> states;
+
+    // Number of times the part was walked since the profile last took it, only counted for a profile
+    uint64_t runs = 0;
+};
+
+struct TraceOp
+{
+    void* label;
+    bef_t imm;
+    Instr instr;
+};
+
+// Immediate of Push_str, the literals from first to first + count
+inline bef_t str_span(uint32_t first, uint32_t count) { return bef_t{.i = (int64_t) first << 32 | count}; }
+
+inline uint32_t span_first(bef_t imm) { return imm.i >> 32; }
+
+inline uint32_t span_count(bef_t imm) { return (uint32_t) imm.i; }
+
+// Kinds of values told apart by Facts
+enum class Kind : uint8_t { Any, Int, Cell };
+
+// What holds of the stack at a state on every path the program may take to it from where it started
+// It drives the operations that can skip their checks: Head and Tail of a value known to be a cell,
+// and native code that need not check the depth of the stack
+struct Facts
+{
+    // Number of values at the top whose kind is tracked
+    static constexpr int KNOWN = 4;
+
+    // Depths are capped, so that loops that pop converge in a bounded number of rounds
+    static constexpr int MAX_DEPTH = 1 << 14;
+
+    // Values on the stack at least, the 0 an empty stack reads does not count
+    int depth = 0;
+
+    // Kinds of the top values, the top first, Any from depth on
+    Kind kinds[KNOWN] = {Kind::Any, Kind::Any, Kind::Any, Kind::Any};
+
+    bool operator==(const Facts& other) const;
+
+    // What holds of both
+    static Facts meet(const Facts& a, const Facts& b);
+
+    void push(Kind k);
+
+    Kind pop();
+
+    // Facts after op, list_ops as for TraceCache
+    void apply(const TraceOp& op, bool list_ops);
+};
+
+// Native code of the operations of a trace before its exit, see Jit
+// It gets the address of the stack pointer and the bottom of the stack
+typedef bool (*NativeTrace)(bef_t** sp, bef_t* base);
+
+// A straight path through the grid from an entry (cell, direction) up to the next branch
+// Its exits are the states of the next instructions, so paths that meet share their traces
+struct Trace
+{
+    std::vector<TraceOp> ops;
+
+    // Values pushed by the Push_str operations, in the order they are pushed
+    std::vector<bef_t> literals;
+
+    // Operations the trace stands for, runs of pushes counting one per value
+    size_t steps = 0;
+
+    // State to continue from after Jump and Put
+    int next;
+
+    // States to continue from after a branch, indexed by dir_index of the chosen direction
+    int exits[4];
+
+    // Cells the pc goes through from the entry up to the exit, spaces, bridges and wrapping included,
+    // and from the branch to each exit
+    Walk walk;
+    Walk exit_walks[4];
+
+    // Cells whose content the trace depends on
+    std::bitset<gridH * gridW> cells;
+
+    // Values on the stack at least at the entry, see Facts
+    int depth = 0;
+
+    // Number of times the trace has been entered, only counted until it is compiled to native code
+    unsigned entries = 0;
+
+    NativeTrace native = nullptr;
+
+    // Bytes of the memory of the Jit native takes
+    size_t native_size = 0;
+};
+
+
+// Compiles traces on first use and keeps them until the code they cover changes
+class TraceCache
+{
+private:
+    // Maximum number of operations in a trace, longer paths are split with a Jump
+    static constexpr size_t MAX_OPS = 4096;
+
+    CodeGrid<char>& code;
+
+    Navigator nav;
+
+    // Interpreter labels indexed by Instr
+    void* const* labels;
+
+    std::vector<std::unique_ptr<Trace>> traces;
+
+    // For every cell, the entry states of the traces that may cover it
+    std::vector<std::vector<int>> covering;
+
+    // Number of times each cell has been changed by p
+    std::vector<uint8_t> writes;
+
+    // Labels of the simple instructions indexed by character, nullptr for the rest
+    void* exec_labels[256];
+
+    // Takes the counts of the traces before they are dropped, nullptr if there is no profile
+    Profile* profile = nullptr;
+
+    // Frees the native code of the traces dropped, nullptr without --jit
+    Jit* jit = nullptr;
+
+    // Whether the list operations of --lists are instructions, they are unknown otherwise
+    bool list_ops;
+
+    // Facts at the entry of every state the program can reach, from the states it started from
+    std::vector<Facts> facts;
+    std::vector<bool> reached;
+
+    // Cells that keep being rewritten are compiled to Exec operations when they hold a simple instruction,
+    // so that writing another simple instruction in them does not change any trace
+    bool is_volatile(int cell) { return writes[cell] >= 2; }
+
+    bool is_simple(char c) { return exec_labels[(unsigned char) c] != nullptr; }
+
+    Trace* compile(int entry);
+
+    void drop(int state);
+
+    // Carries the facts at the states of queue over their traces to the states after them, until nothing
+    // changes. Traces whose facts get weaker are dropped, they are compiled again from the new ones
+    void infer(std::vector<int>& queue);
+
+public:
+    TraceCache(CodeGrid<char>& code, void* const* labels, bool list_ops);
+
+    Trace* get(int state)
+    {
+        Trace* t = traces[state].get();
+        return t ? t : compile(state);
+    }
+
+    // The program starts or resumes at state, which is then a state it can reach
+    // The traces compiled from then on only skip the checks the states they can be entered from allow
+    void start(int state);
+
+    // Label executing character c in place of an Exec operation
+    void* exec(char c) { return exec_labels[(unsigned char) c]; }
+
+    // Keeps the states walked by the traces compiled from now on, and hands their counts to p
+    void set_profile(Profile* p) { profile = p; }
+
+    // Hands the native code of the traces dropped from now on back to j
+    void set_jit(Jit* j) { jit = j; }
+
+    // Hands the counts of every trace to the profile
+    void fold();
+
+    // Drops the traces that depend on cell (y, x). Must be called after the cell changes from old
+    // The facts are then carried over the traces that replace them
+    // Returns the number of traces dropped
+    size_t invalidate(int y, int x, char old);
+};
@@ -0,0 +1,131 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "profile.hpp"
+#include "trace.hpp"
+#include "tracer.hpp"
+
+// Reader of the dumps of --trace, prints the traces entered with the cells they walk, and the writes of p
+// The code is taken back to what it was at the oldest record by undoing the writes kept, then the traces
+// are compiled again from it as the run went
+
+namespace {
+
+void print_usage()
+{
+    std::printf("Usage:\n./befunge93-trace [--last <n>] <trace_file>\n"
+                "  --last <n>  only print the last n records\n");
+}
+
+
+// The characters of the states walked, runs of spaces shown as one
+std::string walked(CodeGrid<char>& code, const std::vector<int>& states)
+{
+    std::string s;
+    for (int state : states)
+    {
+        char c = code(state_pos(state));
+        if (c < 0x20 || c >= 0x7f) c = '?';
+        if (c != ' ' || s.empty() || s.back() != ' ') s += c;
+    }
+    return s;
+}
+
+}
+
+
+int main(int argc, char** argv)
+{
+    const char* filename = nullptr;
+    uint64_t last = UINT64_MAX;
+
+    for (int a = 1; a < argc; a++)
+    {
+        std::string arg = argv[a];
+        if (arg == "--last" && a + 1 < argc) last = std::strtoull(argv[++a], nullptr, 10);
+        else if (arg.compare(0, 2, "--") != 0 && !filename) filename = argv[a];
+        else filename = nullptr, a = argc;
+    }
+
+    if (!filename)
+    {
+        print_usage();
+        return 0;
+    }
+
+    std::ifstream in(filename, std::ios::binary);
+    if (in.fail())
+    {
+        std::fprintf(stderr, "Opening trace fail\n");
+        return 1;
+    }
+
+    Tracer::Header h;
+    if (!in.read((char*) &h, sizeof(h)) || std::memcmp(h.magic, Tracer::MAGIC, sizeof(Tracer::MAGIC)) != 0
+        || h.version != Tracer::VERSION || h.width != gridW || h.height != gridH)
+    {
+        std::fprintf(stderr, "Not a trace\n");
+        return 1;
+    }
+
+    static CodeGrid<char> code;
+    for (int y = 0; y < gridH; y++)
+        for (int x = 0; x < gridW; x++) code(y, x) = in.get();
+
+    std::vector<Tracer::Record> records(h.kept);
+    if (!in.read((char*) records.data(), records.size() * sizeof(Tracer::Record)))
+    {
+        std::fprintf(stderr, "Trace is truncated\n");
+        return 1;
+    }
+
+    for (const Tracer::Record& r : records)
+        if (r.state >= numStates || r.state < -gridH * gridW)
+        {
+            std::fprintf(stderr, "Not a trace\n");
+            return 1;
+        }
+
+    for (size_t i = records.size(); i-- > 0;)
+        if (records[i].state < 0) code(Position::from_index(-1 - records[i].state)) = records[i].depth & 0xff;
+
+    // No labels are needed, only the walks are looked at, which are kept for a profile
+    static void* const labels[Num_instrs] = {};
+    static Profile profile;
+    TraceCache traces(code, labels, h.list_ops);
+    traces.set_profile(&profile);
+
+    static const char* const dir_names[] = {"right", "down", "left", "up"};
+
+    std::printf("%llu records, the last %llu kept\n", (unsigned long long) h.records, (unsigned long long) h.kept);
+    uint64_t first = h.records - h.kept;
+    uint64_t shown = records.size() > last ? records.size() - last : 0;
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        const Tracer::Record& r = records[i];
+        if (r.state < 0)
+        {
+            Position p = Position::from_index(-1 - r.state);
+            char old = r.depth & 0xff, c = r.depth >> 8 & 0xff;
+            code(p) = c;
+            traces.invalidate(p.y(), p.x(), old);
+            if (i >= shown) std::printf("#%llu p (%d,%d) %d -> %d\n", (unsigned long long) (first + i), p.x(), p.y(), old, c);
+            continue;
+        }
+        if (i < shown) continue;
+
+        Trace* t = traces.get(r.state);
+        Position p = state_pos(r.state);
+        bef_t tos = {.i = r.tos};
+        std::printf("#%llu (%d,%d) %s depth %u top ", (unsigned long long) (first + i), p.x(), p.y(),
+            dir_names[dir_index(state_dir(r.state))], r.depth);
+        if (is_ptr(tos)) std::printf("cell");
+        else std::printf("%lld", (long long) bef2int(tos));
+        std::printf(" | %s\n", walked(code, t->walk.states).c_str());
+    }
+    return 0;
+}
@@ -0,0 +1,149 @@
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "tracer.hpp"
+
+constexpr char Tracer::MAGIC[8];
+
+Tracer* Tracer::active_ = nullptr;
+
+// Signals that dump the trace, and the handlers they had before
+static const int dump_signals[] = {SIGINT, SIGTERM, SIGSEGV, SIGBUS};
+static struct sigaction previous[sizeof(dump_signals) / sizeof(dump_signals[0])];
+
+
+Tracer::Tracer(size_t records) :
+    capacity(1),
+    count(0),
+    code(nullptr),
+    list_ops(false),
+    path(nullptr)
+{
+    while (capacity < records) capacity <<= 1;
+
+    // The pages are only committed once they are touched
+    void* p = mmap(nullptr, capacity * sizeof(Record), PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+    {
+        std::cerr << "Could not reserve the trace" << std::endl;
+        exit(1);
+    }
+    ring = (Record*) p;
+}
+
+
+Tracer::~Tracer()
+{
+    if (active_ == this) stop();
+    munmap(ring, capacity * sizeof(Record));
+}
+
+
+void Tracer::attach(CodeGrid<char>& c, bool lists)
+{
+    code = &c;
+    list_ops = lists;
+    count = 0;
+}
+
+
+// The handler replaced runs after the dump, a fault it recovers from, such as a stack overflow,
+// is dumped again by the run that fails
+void Tracer::on_signal(int sig, siginfo_t* info, void* context)
+{
+    if (active_) active_->dump(active_->path);
+
+    for (size_t i = 0; i < sizeof(dump_signals) / sizeof(dump_signals[0]); i++)
+    {
+        if (dump_signals[i] != sig) continue;
+
+        const struct sigaction& old = previous[i];
+        if (old.sa_flags & SA_SIGINFO) old.sa_sigaction(sig, info, context);
+        else if (old.sa_handler != SIG_DFL && old.sa_handler != SIG_IGN) old.sa_handler(sig);
+        else
+        {
+            // A fault comes back once the handler returns, other signals are sent again, both to the
+            // default action, and are blocked until then
+            signal(sig, old.sa_handler);
+            if (sig != SIGSEGV && sig != SIGBUS) raise(sig);
+        }
+        return;
+    }
+}
+
+
+void Tracer::start(const char* p)
+{
+    active_ = this;
+    path = p;
+
+    struct sigaction sa = {};
+    sa.sa_sigaction = on_signal;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    for (size_t i = 0; i < sizeof(dump_signals) / sizeof(dump_signals[0]); i++)
+        sigaction(dump_signals[i], &sa, &previous[i]);
+}
+
+
+void Tracer::stop()
+{
+    if (active_ != this) return;
+
+    for (size_t i = 0; i < sizeof(dump_signals) / sizeof(dump_signals[0]); i++)
+        sigaction(dump_signals[i], &previous[i], nullptr);
+    active_ = nullptr;
+}
+
+
+// Writes all of size bytes, or fails
+static bool write_all(int fd, const void* data, size_t size)
+{
+    const char* p = (const char*) data;
+    while (size > 0)
+    {
+        ssize_t n = write(fd, p, size);
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+
+bool Tracer::dump(const char* p) const
+{
+    if (!code) return false;
+
+    int fd = open(p, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+
+    uint64_t n = count;
+    uint64_t kept = n < capacity ? n : capacity;
+
+    Header h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, MAGIC, sizeof(MAGIC));
+    h.version = VERSION;
+    h.width = gridW;
+    h.height = gridH;
+    h.list_ops = list_ops;
+    h.records = n;
+    h.kept = kept;
+    bool ok = write_all(fd, &h, sizeof(h));
+
+    for (int y = 0; y < gridH && ok; y++) ok = write_all(fd, &(*code)(y, 0), gridW);
+
+    // The ring wraps at most once between the oldest record kept and the end
+    size_t first = (n - kept) & (capacity - 1);
+    size_t before_end = kept < capacity - first ? kept : capacity - first;
+    ok = ok && write_all(fd, ring + first, before_end * sizeof(Record));
+    ok = ok && write_all(fd, ring, (kept - before_end) * sizeof(Record));
+
+    return close(fd) == 0 && ok;
+}
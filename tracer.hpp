@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+
+#include "bef_type.hpp"
+#include "grid.hpp"
+
+// Execution trace of --trace, the last records of a run kept in a ring and written out in binary
+// on exit, on error or when a signal ends the process, see befunge93-trace for reading them
+// A record is taken at the entry of every trace, and at every p that changes the code, so that
+// the cells in between can be found again from the code
+class Tracer
+{
+public:
+    // Default number of records kept, 1MB of them, which stay in the cache as the ring goes round
+    static constexpr size_t DEFAULT_RECORDS = 1 << 16;
+
+    static constexpr char MAGIC[8] = {'B', 'E', 'F', '+', 'T', 'R', 'A', 'C'};
+    static constexpr uint32_t VERSION = 1;
+
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t width;
+        uint32_t height;
+        uint32_t list_ops;
+        uint64_t records;    // Records taken since the code was attached
+        uint64_t kept;       // Records that follow, the last ones taken
+    };
+
+    // The entry of the trace at state with depth values on the stack, the top being tos, an empty stack
+    // counting as one 0, or for a negative state, a p writing cell -1 - state, with its old and new
+    // content in the low bytes of depth
+    struct Record
+    {
+        int32_t state;
+        uint32_t depth;
+        int64_t tos;
+    };
+
+private:
+    // Tracer the signals dump, only one at a time since the handlers belong to the process
+    static Tracer* active_;
+
+    Record* ring;
+    size_t capacity;
+    uint64_t count;
+
+    // The code the records run, written along with them
+    CodeGrid<char>* code;
+    bool list_ops;
+
+    const char* path;
+
+    static void on_signal(int sig, siginfo_t* info, void* context);
+
+public:
+    // Keeps the last records, rounded up to a power of 2
+    explicit Tracer(size_t records = DEFAULT_RECORDS);
+
+    ~Tracer();
+
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    // Drops the records, the next ones run code, compiled with list operations or not
+    void attach(CodeGrid<char>& code, bool list_ops);
+
+    // Dumps to path when SIGINT, SIGTERM or a fault ends the process, before the handler it replaces
+    void start(const char* path);
+
+    void stop();
+
+    // The record is complete before it is counted, so that a signal never dumps half of one
+    void enter(int state, size_t depth, bef_t tos)
+    {
+        Record& r = ring[count & (capacity - 1)];
+        r.state = state;
+        r.depth = depth;
+        r.tos = tos.i;
+        std::atomic_signal_fence(std::memory_order_release);
+        count++;
+    }
+
+    void put(int y, int x, char old, char c)
+    {
+        enter(-1 - Position(y, x).index(), (unsigned char) old | (unsigned char) c << 8, int2bef(0));
+    }
+
+    // Writes the header, the code and the records kept, oldest first, to path
+    // Only makes system calls, so that it can be called from a signal handler
+    bool dump(const char* path) const;
+};
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <csetjmp>
+
+// Errors that stop a program in the middle of an operation
+enum class Fault : int
+{
+    None,
+    Out_of_memory,
+    Stack_overflow,
+    Not_a_cell       // h or t of an integer
+};
+
+//Singleton class for the place faults return to
+//While a Vm runs, a fault jumps back to it, otherwise the fault ends the process
+class Trap
+{
+public:
+    Trap() = delete;
+
+    // Where faults of the thread jump to, nullptr if they end the process
+    static sigjmp_buf*& target()
+    {
+        static __thread sigjmp_buf* t = nullptr;
+        return t;
+    }
+
+    // Jumps to the target with f if there is one, returns otherwise
+    // Also called from the SIGSEGV handler, so it only reads a pointer
+    static void raise(Fault f)
+    {
+        if (target()) siglongjmp(*target(), (int) f);
+    }
+};
@@ -0,0 +1,234 @@
+#include <algorithm>
+#include <csetjmp>
+#include <fstream>
+#include <sstream>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "vm.hpp"
+#include "snapshot.hpp"
+#include "tracer.hpp"
+#include "trap.hpp"
+
+
+Vm::Vm() : Vm(Options()) {}
+
+
+Vm::Vm(const Options& options) :
+    options(options),
+    state(make_state(Position(0, 0), Direction::Right)),
+    status_(Status::Error),
+    message("No code loaded"),
+    stack(Stack::create(options.stack_size)),
+    heap(Heap::create(options.heap_size, options.huge_pages)),
+    sink{nullptr, nullptr},
+    random(Random::create(options.seed)),
+    input_buf(INPUT_SIZE),
+    profile(nullptr),
+    tracer(nullptr),
+    checkpoint_writer(0)
+{
+    input = Input::create(nullptr, nullptr, input_buf.data(), input_buf.size());
+
+    if (options.generational || options.mark_work || options.mark_slice_ns)
+    {
+        Heap::State outer = Heap::swap(heap);
+        if (options.mark_work || options.mark_slice_ns) Heap::use_incremental(options.mark_work, options.mark_slice_ns);
+        if (options.generational) Heap::use_nursery();
+        heap = Heap::swap(outer);
+    }
+}
+
+
+Vm::~Vm()
+{
+    wait_checkpoint();
+    Stack::destroy(stack);
+    Heap::destroy(heap);
+}
+
+
+Vm::Status Vm::fail(const std::string& error)
+{
+    status_ = Status::Error;
+    message = error;
+    return status_;
+}
+
+
+bool Vm::load(const char* data, size_t size)
+{
+    for (int y = 0; y < gridH; y++)
+        for (int x = 0; x < gridW; x++)
+            code(y, x) = ' ';
+
+    const char* end = data + size;
+    for (int i = 0; i < gridH && data < end; i++)
+    {
+        const char* line = data;
+        data = std::find(line, end, '\n');
+        if (data - line > gridW)
+        {
+            fail("Line width more than allowed. Line " + std::to_string(i));
+            return false;
+        }
+
+        Position p(i, 0);
+        for (; line < data; ++line, ++p) code(p) = *line;
+        if (data < end) data++;
+    }
+
+    // The traces of the previous code are dropped along with the stack, the heap is left to the collector
+    interpreter.reset(new Interpreter(code, options.jit, options.list_ops));
+    if (profile) interpreter->set_profile(profile);
+    if (tracer)
+    {
+        interpreter->set_tracer(tracer);
+        tracer->attach(code, options.list_ops);
+    }
+    state = make_state(Position(0, 0), Direction::Right);
+    stack.sp = stack.stack - 1;
+    random = Random::create(options.seed);
+    status_ = Status::Paused;
+    message.clear();
+    return true;
+}
+
+
+bool Vm::load_file(const char* filename)
+{
+    std::ifstream file(filename, std::ios::binary);
+    if (file.fail())
+    {
+        fail("Opening file fail");
+        return false;
+    }
+
+    std::stringstream contents;
+    contents << file.rdbuf();
+    std::string s = contents.str();
+    return load(s.data(), s.size());
+}
+
+
+bool Vm::restore(const char* filename)
+{
+    int restored;
+    Random::State restored_random;
+    std::string error;
+    stack.sp = stack.stack - 1;
+
+    Stack::State outer_stack = Stack::swap(stack);
+    Heap::State outer_heap = Heap::swap(heap);
+    bool ok = Snapshot::read(filename, code, restored, restored_random, (stack.guard - (char*) stack.stack) / sizeof(bef_t),
+        error);
+    heap = Heap::swap(outer_heap);
+    stack = Stack::swap(outer_stack);
+
+    if (!ok)
+    {
+        stack.sp = stack.stack - 1;
+        fail(error);
+        return false;
+    }
+
+    interpreter.reset(new Interpreter(code, options.jit, options.list_ops));
+    if (profile) interpreter->set_profile(profile);
+    if (tracer)
+    {
+        interpreter->set_tracer(tracer);
+        tracer->attach(code, options.list_ops);
+    }
+    state = restored;
+    random = restored_random;
+    status_ = Status::Paused;
+    message.clear();
+    return true;
+}
+
+
+bool Vm::checkpoint(const char* filename)
+{
+    if (!wait_checkpoint()) return false;
+
+    // The child has a copy of the heap and the stack as they are, and only writes them out
+    pid_t pid = fork();
+    if (pid < 0) return false;
+    if (pid == 0)
+    {
+        Heap::swap(heap);
+        _exit(Snapshot::write(filename, code, state, random, stack) ? 0 : 1);
+    }
+
+    checkpoint_writer = pid;
+    return true;
+}
+
+
+bool Vm::wait_checkpoint()
+{
+    if (checkpoint_writer == 0) return true;
+
+    int status;
+    bool ok = waitpid(checkpoint_writer, &status, 0) == checkpoint_writer && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    checkpoint_writer = 0;
+    return ok;
+}
+
+
+void Vm::set_output(Output::Writer writer, void* user)
+{
+    sink = Output::Sink{writer, user};
+}
+
+
+void Vm::set_input(Input::Reader reader, void* user)
+{
+    input = Input::create(reader, user, input_buf.data(), input_buf.size());
+}
+
+
+Vm::Status Vm::run(uint64_t max_steps)
+{
+    if (status_ != Status::Paused) return status_;
+
+    Stack::State outer_stack = Stack::swap(stack);
+    Heap::State outer_heap = Heap::swap(heap);
+    Input::State outer_input = Input::swap(input);
+    Random::State outer_random = Random::swap(random);
+    Output::Sink outer_sink = Output::redirect(sink);
+
+    // Running out of memory or stack jumps back here, which leaves the Vm failed
+    sigjmp_buf trap;
+    sigjmp_buf* outer_trap = Trap::target();
+    Trap::target() = &trap;
+
+    Interpreter::Stop stop = Interpreter::Stop::Paused;
+    Fault fault = (Fault) sigsetjmp(trap, 1);
+    if (fault == Fault::None) stop = interpreter->run(state, max_steps);
+    interpreter->fold_profile();
+
+    Trap::target() = outer_trap;
+    sink = Output::redirect(outer_sink);
+    random = Random::swap(outer_random);
+    input = Input::swap(outer_input);
+    heap = Heap::swap(outer_heap);
+    stack = Stack::swap(outer_stack);
+
+    switch (fault)
+    {
+        case Fault::Out_of_memory: return fail("Not enough memory");
+        case Fault::Stack_overflow: return fail("Stack overflow");
+        case Fault::Not_a_cell: return fail("Head or tail of an integer");
+        default: break;
+    }
+
+    switch (stop)
+    {
+        case Interpreter::Stop::End: status_ = Status::Finished; break;
+        case Interpreter::Stop::Unknown: fail(std::string("Unknown instruction: ") + interpreter->unknown()); break;
+        default: break;
+    }
+    return status_;
+}
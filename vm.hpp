@@ -0,0 +1,141 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "grid.hpp"
+#include "stack.hpp"
+#include "heap.hpp"
+#include "input.hpp"
+#include "output.hpp"
+#include "random.hpp"
+#include "interpreter.hpp"
+
+class Profile;
+class Tracer;
+
+// A program with its own grid, stack, heap and input and output, for embedding the engine
+// The singletons are switched over to the Vm for the length of each run, so any number
+// of them can take turns on a thread
+class Vm
+{
+public:
+    struct Options
+    {
+        size_t heap_size = Heap::DEFAULT_SIZE;
+        size_t stack_size = Stack::DEFAULT_SIZE;
+        bool jit = false;
+        bool generational = false;
+        bool huge_pages = false;
+
+        // Makes l, n, r, b and s list operations, see Heap::length
+        bool list_ops = false;
+
+        // Budget of the slices of incremental marking, see Heap::use_incremental, both 0 to mark at once
+        size_t mark_work = 0;
+        uint64_t mark_slice_ns = 0;
+
+        // Seed of the directions ? picks, the same seed picks the same ones
+        uint64_t seed = Random::DEFAULT_SEED;
+    };
+
+    enum class Status
+    {
+        Paused,      // Loaded, or stopped by max_steps, run resumes it
+        Finished,    // Ran into @
+        Error        // Failed to load or to run, see error()
+    };
+
+private:
+    static constexpr size_t INPUT_SIZE = 1 << 16;
+
+    Options options;
+
+    CodeGrid<char> code;
+
+    std::unique_ptr<Interpreter> interpreter;
+
+    // Where the program resumes
+    int state;
+
+    Status status_;
+
+    std::string message;
+
+    // Swapped into the singletons while the Vm runs
+    Stack::State stack;
+    Heap::State heap;
+    Input::State input;
+    Output::Sink sink;
+    Random::State random;
+
+    std::vector<char> input_buf;
+
+    Profile* profile;
+
+    Tracer* tracer;
+
+    // Process writing the last checkpoint, 0 if there is none to wait for
+    pid_t checkpoint_writer;
+
+    Status fail(const std::string& error);
+
+public:
+    Vm();
+
+    explicit Vm(const Options& options);
+
+    ~Vm();
+
+    Vm(const Vm&) = delete;
+    Vm& operator=(const Vm&) = delete;
+
+    // Loads code laid out as in a file, and restarts the program at the top left corner, with ? seeded again
+    bool load(const char* data, size_t size);
+
+    bool load_file(const char* filename);
+
+    // Loads the code, the stack, the heap, the pc and the generator of ? of a snapshot written by checkpoint,
+    // and resumes the program from there on the next run
+    bool restore(const char* filename);
+
+    // Writes a snapshot of the paused program to filename from a forked process, so that the program
+    // can go on meanwhile. Returns false if the previous snapshot failed or no process could be forked
+    bool checkpoint(const char* filename);
+
+    // Waits for the last snapshot to be written, returns false if it failed
+    bool wait_checkpoint();
+
+    // The output goes to writer instead of the standard output
+    void set_output(Output::Writer writer, void* user);
+
+    // The input comes from reader instead of the standard input
+    void set_input(Input::Reader reader, void* user);
+
+    // Counts the executions and the g and p accesses of the code loaded from now on in p,
+    // which has to be started for the time spent to be sampled
+    void set_profile(Profile* p) { profile = p; }
+
+    // Records the run of the code loaded from now on in t, which starts over at every load
+    void set_tracer(Tracer* t) { tracer = t; }
+
+    // Runs the program until it ends or fails, or until max_steps operations have run,
+    // in which case it pauses at the start of the next trace
+    // The output written by the run is flushed before it returns
+    Status run(uint64_t max_steps = UINT64_MAX);
+
+    Status status() const { return status_; }
+
+    // Operations run since the code was loaded, see Interpreter::steps
+    uint64_t steps() const { return interpreter ? interpreter->steps() : 0; }
+
+    // Reason of the last failure
+    const std::string& error() const { return message; }
+
+    CodeGrid<char>& grid() { return code; }
+};